@@ -0,0 +1,134 @@
+/*
+  Stress test of the pthreads task system in tasksys.cpp, through the
+  entry points ispc generated code calls.
+
+  Several threads keep many task groups alive at once, more than the 64
+  the runtime recycles, so groups are freed as well as reused, and
+  launch tiny tasks into them and sync them in a shuffled order. Some
+  tasks launch and sync groups of their own. Every task must run exactly
+  once, and a group must never be touched after its Sync() returned,
+  which building with -fsanitize=address (see the Makefile) checks.
+
+  Run it once more with ISPC_TASK_STATS set to cover the statistics.
+*/
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <algorithm>
+#include <atomic>
+#include <random>
+#include <thread>
+#include <vector>
+
+#include "tasksys.h"
+
+extern "C" {
+void ISPCLaunch(void **handlePtr, void *f, void *data, int count);
+void *ISPCAlloc(void **handlePtr, int64_t size, int32_t alignment);
+void ISPCSync(void *handle);
+}
+
+#define NUM_THREADS 8          // Threads of the task system
+#define NUM_LAUNCHERS 4        // Threads launching and syncing groups
+#define GROUPS_PER_LAUNCHER 40 // Live at once, so 160 groups in all
+#define ROUNDS 200
+
+struct Args {
+    std::atomic<int> *hits;
+    int nested;
+};
+
+static std::atomic<bool> failed{false};
+
+static void checkHits(std::atomic<int> *hits, int count, const char *what) {
+    for (int i = 0; i < count; i++) {
+        if (hits[i] != 1) {
+            fprintf(stderr, "Error: %s task %d ran %d times\n", what, i, (int)hits[i]);
+            failed = true;
+        }
+    }
+}
+
+static void leafTask(void *data, int threadIndex, int threadCount, int taskIndex, int taskCount) {
+    Args *args = (Args *)data;
+    if (threadIndex < 0 || threadIndex >= threadCount) {
+        fprintf(stderr, "Error: thread index %d of %d\n", threadIndex, threadCount);
+        failed = true;
+    }
+    args->hits[taskIndex]++;
+}
+
+static void nestingTask(void *data, int threadIndex, int threadCount, int taskIndex, int taskCount) {
+    Args *args = (Args *)data;
+    std::atomic<int> hits[8];
+    for (auto &hit : hits)
+        hit = 0;
+    void *handle = NULL;
+    Args *inner = (Args *)ISPCAlloc(&handle, sizeof(Args), 16);
+    inner->hits = hits;
+    inner->nested = 0;
+    ISPCLaunch(&handle, (void *)leafTask, inner, args->nested);
+    ISPCSync(handle);
+    checkHits(hits, args->nested, "nested");
+    args->hits[taskIndex]++;
+}
+
+static void launcher(int seed) {
+    std::mt19937 random(seed);
+    std::vector<void *> handles(GROUPS_PER_LAUNCHER);
+    std::vector<std::vector<std::atomic<int> *>> hits(GROUPS_PER_LAUNCHER);
+    std::vector<int> counts(GROUPS_PER_LAUNCHER);
+    std::vector<int> order(GROUPS_PER_LAUNCHER);
+    for (int i = 0; i < GROUPS_PER_LAUNCHER; i++)
+        order[i] = i;
+
+    for (int round = 0; round < ROUNDS && !failed; round++) {
+        // Open every group with one to three launches of 1 to 16 tasks
+        for (int g = 0; g < GROUPS_PER_LAUNCHER; g++) {
+            handles[g] = NULL;
+            counts[g] = 1 + random() % 16;
+            int launches = 1 + random() % 3;
+            for (int l = 0; l < launches; l++) {
+                std::atomic<int> *h = new std::atomic<int>[counts[g]];
+                for (int i = 0; i < counts[g]; i++)
+                    h[i] = 0;
+                hits[g].push_back(h);
+                Args *args = (Args *)ISPCAlloc(&handles[g], sizeof(Args), 16);
+                args->hits = h;
+                args->nested = random() % 8 == 0 ? 1 + random() % 8 : 0;
+                ISPCLaunch(&handles[g], args->nested ? (void *)nestingTask : (void *)leafTask,
+                           args, counts[g]);
+            }
+        }
+
+        // And sync them in any order
+        std::shuffle(order.begin(), order.end(), random);
+        for (int g : order) {
+            ISPCSync(handles[g]);
+            for (std::atomic<int> *h : hits[g]) {
+                checkHits(h, counts[g], "launched");
+                delete[] h;
+            }
+            hits[g].clear();
+        }
+    }
+}
+
+int main() {
+    ISPCSetNumThreads(NUM_THREADS);
+
+    std::vector<std::thread> launchers;
+    for (int i = 0; i < NUM_LAUNCHERS; i++)
+        launchers.emplace_back(launcher, i + 1);
+    for (auto &t : launchers)
+        t.join();
+
+    if (failed) {
+        printf("tasksys_test: FAILED\n");
+        return 1;
+    }
+    printf("tasksys_test: %d launchers x %d live groups x %d rounds ok\n", NUM_LAUNCHERS,
+           GROUPS_PER_LAUNCHER, ROUNDS);
+    return 0;
+}
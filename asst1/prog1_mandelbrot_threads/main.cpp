@@ -1,4 +1,6 @@
 #include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
 #include <algorithm>
 #include <getopt.h>
 
@@ -18,6 +20,38 @@ extern void mandelbrotThread(
     int maxIterations,
     int output[]);
 
+extern void mandelbrotSerialAccel(
+    float x0, float y0, float x1, float y1,
+    int width, int height,
+    int startRow, int numRows,
+    int maxIterations,
+    int output[]);
+
+extern void mandelbrotVector(
+    float x0, float y0, float x1, float y1,
+    int width, int height,
+    int startRow, int numRows,
+    int maxIterations,
+    int output[]);
+
+extern void mandelbrotVectorAccel(
+    float x0, float y0, float x1, float y1,
+    int width, int height,
+    int startRow, int numRows,
+    int maxIterations,
+    int output[]);
+
+extern const char* mandelbrotVectorIsa();
+
+extern void mandelbrotThreadTiles(
+    int numThreads, int tileWidth, int tileHeight, bool vector, bool accel,
+    float x0, float y0, float x1, float y1,
+    int width, int height,
+    int maxIterations,
+    int output[]);
+
+extern void printThreadReport();
+
 extern void writePPMImage(
     int* data,
     int width, int height,
@@ -41,11 +75,40 @@ scaleAndShift(float& x0, float& x1, float& y0, float& y1,
 
 }
 
+// Scale and shift of the views after the first, which is the whole set
+static const struct {
+    float scale;
+    float shiftX;
+    float shiftY;
+} views[] = {
+    {  1.f,      0.f,     0.f },  // 1: the whole set
+    { .015f,  -.986f,    .30f },  // 2
+    {  .02f,  -.735f,    .11f },  // 3: seahorse valley
+    {  .02f,    .29f,   .008f },  // 4: elephant valley
+    {  .01f, -1.7499f,    0.f },  // 5: period-3 minibrot
+    { .005f,  -.0855f,  .654f },  // 6: spiral
+};
+static const int numViews = sizeof(views) / sizeof(views[0]);
+
+// Tile shapes tried by --sweep
+static const struct {
+    int width;
+    int height;
+} sweepTiles[] = {
+    { 16, 16 }, { 32, 32 }, { 64, 64 }, { 128, 128 },
+    { 64, 4 }, { 64, 16 }, { 256, 8 }, { 1600, 1 }, { 1600, 8 },
+};
+
 void usage(const char* progname) {
     printf("Usage: %s [options]\n", progname);
     printf("Program Options:\n");
     printf("  -t  --threads <N>  Use N threads\n");
-    printf("  -v  --view <INT>   Use specified view settings\n");
+    printf("  -v  --view <INT>   Use specified view settings (1-%d)\n", numViews);
+    printf("  -T  --tile <WxH>   Tiles of W x H pixels for the threads (default 64x16)\n");
+    printf("  -r  --report       Print the tiles and busy time of every thread\n");
+    printf("  -a  --accel        Skip interior points and periodic orbits, serially and in the threads\n");
+    printf("  -V  --vector       Use the AVX2/AVX-512 kernel, serially and in the threads\n");
+    printf("  -s  --sweep        Time every tile shape on every view\n");
     printf("  -?  --help         This message\n");
 }
 
@@ -66,12 +129,59 @@ bool verifyResult (int *gold, int *result, int width, int height) {
     return 1;
 }
 
+//
+// Time the serial implementation and the threaded one with every tile
+// shape in sweepTiles on every view, checking each result.
+//
+int sweep(int numThreads, bool vector, bool accel, int width, int height, int maxIterations,
+          int* output_serial, int* output_thread) {
+
+    printf("view\ttile\t\tserial ms\tthread ms\tspeedup\n");
+    for (int v = 0; v < numViews; v++) {
+        float x0 = -2, x1 = 1, y0 = -1, y1 = 1;
+        if (v > 0)
+            scaleAndShift(x0, x1, y0, y1, views[v].scale, views[v].shiftX, views[v].shiftY);
+
+        double minSerial = 1e30;
+        for (int i = 0; i < 3; ++i) {
+            double startTime = CycleTimer::currentSeconds();
+            mandelbrotSerial(x0, y0, x1, y1, width, height, 0, height, maxIterations, output_serial);
+            minSerial = std::min(minSerial, CycleTimer::currentSeconds() - startTime);
+        }
+
+        for (auto& tile : sweepTiles) {
+            double minThread = 1e30;
+            for (int i = 0; i < 3; ++i) {
+                memset(output_thread, 0, width * height * sizeof(int));
+                double startTime = CycleTimer::currentSeconds();
+                mandelbrotThreadTiles(numThreads, tile.width, tile.height, vector, accel,
+                                      x0, y0, x1, y1, width, height, maxIterations, output_thread);
+                minThread = std::min(minThread, CycleTimer::currentSeconds() - startTime);
+            }
+            if (! verifyResult (output_serial, output_thread, width, height)) {
+                printf ("Error : Output from threads does not match serial output (view %d, tile %dx%d)\n",
+                        v + 1, tile.width, tile.height);
+                return 1;
+            }
+            printf("%d\t%dx%d\t\t%.3f\t\t%.3f\t\t%.2fx\n", v + 1, tile.width, tile.height,
+                   minSerial * 1000, minThread * 1000, minSerial / minThread);
+        }
+    }
+    return 0;
+}
+
 int main(int argc, char** argv) {
 
     const unsigned int width = 1600;
     const unsigned int height = 1200;
     const int maxIterations = 256;
     int numThreads = 2;
+    int tileWidth = 64;
+    int tileHeight = 16;
+    bool report = false;
+    bool runSweep = false;
+    bool vector = false;
+    bool accel = false;
 
     float x0 = -2;
     float x1 = 1;
@@ -83,11 +193,16 @@ int main(int argc, char** argv) {
     static struct option long_options[] = {
         {"threads", 1, 0, 't'},
         {"view", 1, 0, 'v'},
+        {"tile", 1, 0, 'T'},
+        {"report", 0, 0, 'r'},
+        {"sweep", 0, 0, 's'},
+        {"vector", 0, 0, 'V'},
+        {"accel", 0, 0, 'a'},
         {"help", 0, 0, '?'},
         {0 ,0, 0, 0}
     };
 
-    while ((opt = getopt_long(argc, argv, "t:v:?", long_options, NULL)) != EOF) {
+    while ((opt = getopt_long(argc, argv, "t:v:T:rsVa?", long_options, NULL)) != EOF) {
 
         switch (opt) {
         case 't':
@@ -99,17 +214,36 @@ int main(int argc, char** argv) {
         {
             int viewIndex = atoi(optarg);
             // change view settings
-            if (viewIndex == 2) {
-                float scaleValue = .015f;
-                float shiftX = -.986f;
-                float shiftY = .30f;
-                scaleAndShift(x0, x1, y0, y1, scaleValue, shiftX, shiftY);
-            } else if (viewIndex > 1) {
+            if (viewIndex < 1 || viewIndex > numViews) {
                 fprintf(stderr, "Invalid view index\n");
                 return 1;
+            } else if (viewIndex > 1) {
+                scaleAndShift(x0, x1, y0, y1, views[viewIndex - 1].scale,
+                              views[viewIndex - 1].shiftX, views[viewIndex - 1].shiftY);
             }
             break;
         }
+        case 'T':
+        {
+            if (sscanf(optarg, "%dx%d", &tileWidth, &tileHeight) != 2 ||
+                tileWidth < 1 || tileHeight < 1) {
+                fprintf(stderr, "Invalid tile size, expected WxH\n");
+                return 1;
+            }
+            break;
+        }
+        case 'r':
+            report = true;
+            break;
+        case 's':
+            runSweep = true;
+            break;
+        case 'V':
+            vector = true;
+            break;
+        case 'a':
+            accel = true;
+            break;
         case '?':
         default:
             usage(argv[0]);
@@ -122,6 +256,13 @@ int main(int argc, char** argv) {
     int* output_serial = new int[width*height];
     int* output_thread = new int[width*height];
 
+    if (runSweep) {
+        int result = sweep(numThreads, vector, accel, width, height, maxIterations, output_serial, output_thread);
+        delete[] output_serial;
+        delete[] output_thread;
+        return result;
+    }
+
     //
     // Run the serial implementation.  Run the code three times and
     // take the minimum to get a good estimate.
@@ -139,6 +280,63 @@ int main(int argc, char** argv) {
     printf("[mandelbrot serial]:\t\t[%.3f] ms\n", minSerial * 1000);
     writePPMImage(output_serial, width, height, "mandelbrot-serial.ppm", maxIterations);
 
+    //
+    // Run the accelerated serial version
+    //
+
+    if (accel) {
+        double minAccel = 1e30;
+        for (int i = 0; i < 5; ++i) {
+            memset(output_thread, 0, width * height * sizeof(int));
+            double startTime = CycleTimer::currentSeconds();
+            mandelbrotSerialAccel(x0, y0, x1, y1, width, height, 0, height, maxIterations, output_thread);
+            double endTime = CycleTimer::currentSeconds();
+            minAccel = std::min(minAccel, endTime - startTime);
+        }
+
+        printf("[mandelbrot accel]:\t\t[%.3f] ms\t(%.2fx speedup)\n",
+               minAccel * 1000, minSerial / minAccel);
+
+        if (! verifyResult (output_serial, output_thread, width, height)) {
+            printf ("Error : Output from accelerated mode does not match serial output\n");
+
+            delete[] output_serial;
+            delete[] output_thread;
+
+            return 1;
+        }
+    }
+
+    //
+    // Run the serial vector version
+    //
+
+    if (vector) {
+        double minVector = 1e30;
+        for (int i = 0; i < 5; ++i) {
+            memset(output_thread, 0, width * height * sizeof(int));
+            double startTime = CycleTimer::currentSeconds();
+            if (accel)
+                mandelbrotVectorAccel(x0, y0, x1, y1, width, height, 0, height, maxIterations, output_thread);
+            else
+                mandelbrotVector(x0, y0, x1, y1, width, height, 0, height, maxIterations, output_thread);
+            double endTime = CycleTimer::currentSeconds();
+            minVector = std::min(minVector, endTime - startTime);
+        }
+
+        printf("[mandelbrot vector]:\t\t[%.3f] ms\t(%.2fx speedup from %s)\n",
+               minVector * 1000, minSerial / minVector, mandelbrotVectorIsa());
+
+        if (! verifyResult (output_serial, output_thread, width, height)) {
+            printf ("Error : Output from vector kernel does not match serial output\n");
+
+            delete[] output_serial;
+            delete[] output_thread;
+
+            return 1;
+        }
+    }
+
     //
     // Run the threaded version
     //
@@ -147,12 +345,15 @@ int main(int argc, char** argv) {
     for (int i = 0; i < 5; ++i) {
       memset(output_thread, 0, width * height * sizeof(int));
         double startTime = CycleTimer::currentSeconds();
-        mandelbrotThread(numThreads, x0, y0, x1, y1, width, height, maxIterations, output_thread);
+        mandelbrotThreadTiles(numThreads, tileWidth, tileHeight, vector, accel,
+                              x0, y0, x1, y1, width, height, maxIterations, output_thread);
         double endTime = CycleTimer::currentSeconds();
         minThread = std::min(minThread, endTime - startTime);
     }
 
     printf("[mandelbrot thread]:\t\t[%.3f] ms\n", minThread * 1000);
+    if (report)
+        printThreadReport();
     writePPMImage(output_thread, width, height, "mandelbrot-thread.ppm", maxIterations);
 
     if (! verifyResult (output_serial, output_thread, width, height)) {
@@ -37,6 +37,7 @@
    SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
 */
 
+#include <algorithm>
 
 static inline int mandel(float c_re, float c_im, int count)
 {
@@ -90,3 +91,160 @@ void mandelbrotSerial(
     }
 }
 
+
+//
+// MandelbrotSerialTile --
+//
+// Like mandelbrotSerial(), but only computes the columns
+// [startCol, startCol + numCols) of the rows [startRow, startRow +
+// numRows). Every pixel gets exactly the value mandelbrotSerial() gives
+// it, since its coordinates are computed the same way.
+void mandelbrotSerialTile(
+    float x0, float y0, float x1, float y1,
+    int width, int height,
+    int startCol, int numCols,
+    int startRow, int numRows,
+    int maxIterations,
+    int output[])
+{
+    float dx = (x1 - x0) / width;
+    float dy = (y1 - y0) / height;
+
+    int endRow = std::min(startRow + numRows, height);
+    int endCol = std::min(startCol + numCols, width);
+
+    for (int j = startRow; j < endRow; j++) {
+        for (int i = startCol; i < endCol; ++i) {
+            float x = x0 + i * dx;
+            float y = y0 + j * dy;
+
+            int index = (j * width + i);
+            output[index] = mandel(x, y, maxIterations);
+        }
+    }
+}
+
+
+//
+// Accelerated mode --
+//
+// mandelbrotSerialAccel() computes exactly the image of mandelbrotSerial()
+// with less work on points of the set:
+//
+// * Points inside the main cardioid or the period-2 bulb are in the set,
+//   so they get maxIterations without iterating. The tests are shrunk a
+//   little so that a point right on the boundary, whose float orbit may
+//   still escape, is iterated like before.
+// * The orbit is checked for a cycle, Brent style: it is compared to a
+//   saved point which is replaced after 1, 2, 4, 8... iterations. Since
+//   the float iteration is a function of z alone, an orbit which comes
+//   back to an exact earlier value will never escape. The check only
+//   starts after CYCLE_CHECK_AFTER iterations, since most orbits which
+//   escape do so earlier and would only pay for the bookkeeping.
+//
+
+static constexpr int CYCLE_CHECK_AFTER = 64;
+
+static inline int mandelAccel(float c_re, float c_im, int count)
+{
+    float xq = c_re - .25f;
+    float q = xq * xq + c_im * c_im;
+    if (q * (q + xq) < .2495f * c_im * c_im)
+        return count;
+    if ((c_re + 1.f) * (c_re + 1.f) + c_im * c_im < .0624f)
+        return count;
+
+    float z_re = c_re, z_im = c_im;
+    int i;
+    for (i = 0; i < count && i < CYCLE_CHECK_AFTER; ++i) {
+
+        if (z_re * z_re + z_im * z_im > 4.f)
+            return i;
+
+        float new_re = z_re*z_re - z_im*z_im;
+        float new_im = 2.f * z_re * z_im;
+        z_re = c_re + new_re;
+        z_im = c_im + new_im;
+    }
+
+    float saved_re = z_re, saved_im = z_im;
+    int steps = 0, period = 1;
+    for (; i < count; ++i) {
+
+        if (z_re * z_re + z_im * z_im > 4.f)
+            break;
+
+        float new_re = z_re*z_re - z_im*z_im;
+        float new_im = 2.f * z_re * z_im;
+        z_re = c_re + new_re;
+        z_im = c_im + new_im;
+
+        if (z_re == saved_re && z_im == saved_im)
+            return count;
+        if (++steps == period) {
+            saved_re = z_re;
+            saved_im = z_im;
+            steps = 0;
+            period *= 2;
+        }
+    }
+
+    return i;
+}
+
+//
+// MandelbrotSerialAccel --
+//
+// mandelbrotSerial() in the accelerated mode described above.
+void mandelbrotSerialAccel(
+    float x0, float y0, float x1, float y1,
+    int width, int height,
+    int startRow, int totalRows,
+    int maxIterations,
+    int output[])
+{
+    float dx = (x1 - x0) / width;
+    float dy = (y1 - y0) / height;
+
+    int endRow = startRow + totalRows;
+
+    for (int j = startRow; j < endRow; j++) {
+        for (int i = 0; i < width; ++i) {
+            float x = x0 + i * dx;
+            float y = y0 + j * dy;
+
+            int index = (j * width + i);
+            output[index] = mandelAccel(x, y, maxIterations);
+        }
+    }
+}
+
+
+//
+// MandelbrotSerialAccelTile --
+//
+// mandelbrotSerialTile() in the accelerated mode described above.
+void mandelbrotSerialAccelTile(
+    float x0, float y0, float x1, float y1,
+    int width, int height,
+    int startCol, int numCols,
+    int startRow, int numRows,
+    int maxIterations,
+    int output[])
+{
+    float dx = (x1 - x0) / width;
+    float dy = (y1 - y0) / height;
+
+    int endRow = std::min(startRow + numRows, height);
+    int endCol = std::min(startCol + numCols, width);
+
+    for (int j = startRow; j < endRow; j++) {
+        for (int i = startCol; i < endCol; ++i) {
+            float x = x0 + i * dx;
+            float y = y0 + j * dy;
+
+            int index = (j * width + i);
+            output[index] = mandelAccel(x, y, maxIterations);
+        }
+    }
+}
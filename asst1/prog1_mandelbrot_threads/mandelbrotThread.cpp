@@ -1,135 +1,256 @@
 #include <stdio.h>
+#include <stdlib.h>
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <mutex>
 #include <thread>
+#include <vector>
 
 #include "CycleTimer.h"
 
-typedef struct {
-    float x0, x1;
-    float y0, y1;
-    unsigned int width;
-    unsigned int height;
-    int maxIterations;
-    int* output;
-    int threadId;
-    int numThreads;
-} WorkerArgs;
+extern void mandelbrotSerialTile(
+    float x0, float y0, float x1, float y1,
+    int width, int height,
+    int startCol, int numCols,
+    int startRow, int numRows,
+    int maxIterations,
+    int output[]);
 
+extern void mandelbrotSerialAccelTile(
+    float x0, float y0, float x1, float y1,
+    int width, int height,
+    int startCol, int numCols,
+    int startRow, int numRows,
+    int maxIterations,
+    int output[]);
 
-extern void mandelbrotSerial(
+extern void mandelbrotVectorTile(
     float x0, float y0, float x1, float y1,
     int width, int height,
+    int startCol, int numCols,
     int startRow, int numRows,
     int maxIterations,
     int output[]);
 
+extern void mandelbrotVectorAccelTile(
+    float x0, float y0, float x1, float y1,
+    int width, int height,
+    int startCol, int numCols,
+    int startRow, int numRows,
+    int maxIterations,
+    int output[]);
+
+typedef void (*TileFunc)(
+    float x0, float y0, float x1, float y1,
+    int width, int height,
+    int startCol, int numCols,
+    int startRow, int numRows,
+    int maxIterations,
+    int output[]);
+
+// The tile shape mandelbrotThread() uses, see mandelbrotThreadTiles()
+static constexpr int DEFAULT_TILE_WIDTH = 64;
+static constexpr int DEFAULT_TILE_HEIGHT = 16;
+
+static constexpr int MAX_THREADS = 32;
 
 //
-// workerThreadStart --
+// ThreadStats --
 //
-// Thread entrypoint.
-void workerThreadStart(WorkerArgs * const args) {
+// What each thread did during the last call to mandelbrotThreadTiles():
+// how many tiles it computed and the time it spent computing them.
+struct ThreadStats {
+    int numThreads;
+    double wallTime;
+    int tiles[MAX_THREADS];
+    double busyTime[MAX_THREADS];
+};
 
-    // TODO FOR CS149 STUDENTS: Implement the body of the worker
-    // thread here. Each thread should make a call to mandelbrotSerial()
-    // to compute a part of the output image.  For example, in a
-    // program that uses two threads, thread 0 could compute the top
-    // half of the image and thread 1 could compute the bottom half.
+static ThreadStats lastStats;
 
-    double startTime = CycleTimer::currentSeconds();
-    int numRows =  args->height / args->numThreads;
-    int remainRows = args->height % args->numThreads;
-    int startRow = args->threadId * numRows;
-    if(args->threadId == args->numThreads - 1 && remainRows != 0) {
-      numRows += remainRows;
+typedef struct {
+    float x0, x1;
+    float y0, y1;
+    int width;
+    int height;
+    int maxIterations;
+    int* output;
+    int tileWidth;
+    int tileHeight;
+    int tilesPerRow;
+    int numTiles;
+    TileFunc tile;
+} Job;
+
+//
+// TilePool --
+//
+// numThreads - 1 threads which live from one call to the next, plus the
+// calling thread. Every thread pulls tiles off a shared atomic counter
+// until none are left, so a thread which gets cheap tiles simply takes
+// more of them, whatever the view.
+class TilePool {
+private:
+    std::vector<std::thread> threads;
+    std::mutex mutex;
+    std::condition_variable startCv;
+    std::condition_variable doneCv;
+    int generation = 0; // Bumped for every job
+    int running = 0; // Pool threads still working on the current job
+    bool stop = false;
+    Job job;
+    std::atomic<int> nextTile {0};
+
+    void work(int threadId, const Job& job) {
+        double startTime = CycleTimer::currentSeconds();
+        int tiles = 0;
+        while (true) {
+            int tile = nextTile.fetch_add(1, std::memory_order_relaxed);
+            if (tile >= job.numTiles)
+                break;
+            int startCol = (tile % job.tilesPerRow) * job.tileWidth;
+            int startRow = (tile / job.tilesPerRow) * job.tileHeight;
+            job.tile(job.x0, job.y0, job.x1, job.y1, job.width, job.height,
+                     startCol, job.tileWidth, startRow, job.tileHeight,
+                     job.maxIterations, job.output);
+            tiles++;
+        }
+        lastStats.tiles[threadId] = tiles;
+        lastStats.busyTime[threadId] = CycleTimer::currentSeconds() - startTime;
     }
-    mandelbrotSerial(args->x0, args->y0, args->x1, args->y1,
-                    args->width, args->height, startRow, numRows,
-                    args->maxIterations ,args->output);
-    double endTime = CycleTimer::currentSeconds();
-    double interval = endTime - startTime;
-    printf("[thread %d]:\t\t[%.3f] ms\n", args->threadId ,interval * 1000);
-    printf("Hello world from thread %d\n", args->threadId);
-}
 
-void workerThreadStartBalance(WorkerArgs * const args) {
+    void threadLoop(int threadId) {
+        int seen = 0;
+        while (true) {
+            Job current;
+            {
+                std::unique_lock<std::mutex> lock(mutex);
+                startCv.wait(lock, [&] { return stop || generation != seen; });
+                if (stop)
+                    return;
+                seen = generation;
+                current = job;
+            }
+            work(threadId, current);
+            std::lock_guard<std::mutex> lock(mutex);
+            if (--running == 0)
+                doneCv.notify_one();
+        }
+    }
 
-    double startTime = CycleTimer::currentSeconds();
-    int numRows =  args->height / args->numThreads;
-    for(int i = 0;i < numRows; ++i) {
-      int startRow = i * args->numThreads + args->threadId;
-      mandelbrotSerial(args->x0, args->y0, args->x1, args->y1,
-                       args->width, args->height, startRow, 1,
-                       args->maxIterations ,args->output);
+    void shutdown() {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            stop = true;
+        }
+        startCv.notify_all();
+        for (auto& thread : threads)
+            thread.join();
+        threads.clear();
+        stop = false;
     }
 
-    // Here we need to handle some corner case
-    int remainRows = args->height % args->numThreads - 1;
-    if(remainRows >= 0 && args->threadId <= remainRows) {
-      int startRow = numRows * args->numThreads + args->threadId;
-      mandelbrotSerial(args->x0, args->y0, args->x1, args->y1,
-                       args->width, args->height, startRow, 1,
-                       args->maxIterations ,args->output);
+public:
+    ~TilePool() {
+        shutdown();
     }
 
-    double endTime = CycleTimer::currentSeconds();
-    double interval = endTime - startTime;
-    printf("[thread %d]:\t\t[%.3f] ms\n", args->threadId ,interval * 1000);
-    printf("Hello world from thread %d\n", args->threadId);
-}
+    // Run `newJob` on numThreads threads, the calling thread included.
+    void run(int numThreads, const Job& newJob) {
+        if ((int)threads.size() != numThreads - 1) {
+            shutdown();
+            for (int i = 1; i < numThreads; i++)
+                threads.emplace_back(&TilePool::threadLoop, this, i);
+        }
+
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            job = newJob;
+            nextTile = 0;
+            running = numThreads - 1;
+            generation++;
+        }
+        startCv.notify_all();
+
+        work(0, newJob);
+
+        std::unique_lock<std::mutex> lock(mutex);
+        doneCv.wait(lock, [&] { return running == 0; });
+    }
+};
+
+static TilePool pool;
 
 //
-// MandelbrotThread --
+// MandelbrotThreadTiles --
 //
 // Multi-threaded implementation of mandelbrot set image generation.
-// Threads of execution are created by spawning std::threads.
-void mandelbrotThread(
-    int numThreads,
+// The image is cut into tiles of tileWidth x tileHeight pixels, which
+// numThreads threads of a persistent pool compute in row-major order,
+// each taking the next tile as soon as it is done with the last. With
+// `vector` set, the tiles are computed by mandelbrotVectorTile(), and
+// with `accel` set in the accelerated mode of mandelbrotSerialAccel().
+void mandelbrotThreadTiles(
+    int numThreads, int tileWidth, int tileHeight, bool vector, bool accel,
     float x0, float y0, float x1, float y1,
     int width, int height,
     int maxIterations, int output[])
 {
-    static constexpr int MAX_THREADS = 32;
-
-    if (numThreads > MAX_THREADS)
+    if (numThreads > MAX_THREADS || numThreads < 1)
     {
-        fprintf(stderr, "Error: Max allowed threads is %d\n", MAX_THREADS);
+        fprintf(stderr, "Error: Threads must be between 1 and %d\n", MAX_THREADS);
         exit(1);
     }
 
-    // Creates thread objects that do not yet represent a thread.
-    std::thread workers[MAX_THREADS];
-    WorkerArgs args[MAX_THREADS];
-
-    for (int i=0; i<numThreads; i++) {
-
-        // TODO FOR CS149 STUDENTS: You may or may not wish to modify
-        // the per-thread arguments here.  The code below copies the
-        // same arguments for each thread
-        args[i].x0 = x0;
-        args[i].y0 = y0;
-        args[i].x1 = x1;
-        args[i].y1 = y1;
-        args[i].width = width;
-        args[i].height = height;
-        args[i].maxIterations = maxIterations;
-        args[i].numThreads = numThreads;
-        args[i].output = output;
-
-        args[i].threadId = i;
-    }
+    Job job;
+    job.x0 = x0;
+    job.y0 = y0;
+    job.x1 = x1;
+    job.y1 = y1;
+    job.width = width;
+    job.height = height;
+    job.maxIterations = maxIterations;
+    job.output = output;
+    job.tileWidth = std::max(1, std::min(tileWidth, width));
+    job.tileHeight = std::max(1, std::min(tileHeight, height));
+    job.tilesPerRow = (width + job.tileWidth - 1) / job.tileWidth;
+    job.numTiles = job.tilesPerRow * ((height + job.tileHeight - 1) / job.tileHeight);
+    if (vector)
+        job.tile = accel ? mandelbrotVectorAccelTile : mandelbrotVectorTile;
+    else
+        job.tile = accel ? mandelbrotSerialAccelTile : mandelbrotSerialTile;
 
-    // Spawn the worker threads.  Note that only numThreads-1 std::threads
-    // are created and the main application thread is used as a worker
-    // as well.
-    for (int i=1; i<numThreads; i++) {
-        workers[i] = std::thread(workerThreadStartBalance, &args[i]);
-    }
+    double startTime = CycleTimer::currentSeconds();
+    pool.run(numThreads, job);
+    lastStats.numThreads = numThreads;
+    lastStats.wallTime = CycleTimer::currentSeconds() - startTime;
+}
 
-    workerThreadStartBalance(&args[0]);
+//
+// MandelbrotThread --
+//
+// mandelbrotThreadTiles() with the default tile shape.
+void mandelbrotThread(
+    int numThreads,
+    float x0, float y0, float x1, float y1,
+    int width, int height,
+    int maxIterations, int output[])
+{
+    mandelbrotThreadTiles(numThreads, DEFAULT_TILE_WIDTH, DEFAULT_TILE_HEIGHT, false, false,
+                          x0, y0, x1, y1, width, height, maxIterations, output);
+}
 
-    // join worker threads
-    for (int i=1; i<numThreads; i++) {
-        workers[i].join();
+//
+// PrintThreadReport --
+//
+// Print the tiles and busy time of every thread during the last call.
+void printThreadReport() {
+    const ThreadStats& stats = lastStats;
+    for (int i = 0; i < stats.numThreads; i++) {
+        printf("[thread %d]:\t\t[%.3f] ms busy (%.0f%%), %d tiles\n", i,
+               stats.busyTime[i] * 1000,
+               stats.wallTime > 0 ? 100 * stats.busyTime[i] / stats.wallTime : 0.,
+               stats.tiles[i]);
     }
 }
-
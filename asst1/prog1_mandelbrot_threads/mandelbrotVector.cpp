@@ -0,0 +1,344 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <algorithm>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define HAVE_X86_KERNELS 1
+#endif
+
+extern void mandelbrotSerialTile(
+    float x0, float y0, float x1, float y1,
+    int width, int height,
+    int startCol, int numCols,
+    int startRow, int numRows,
+    int maxIterations,
+    int output[]);
+
+extern void mandelbrotSerialAccelTile(
+    float x0, float y0, float x1, float y1,
+    int width, int height,
+    int startCol, int numCols,
+    int startRow, int numRows,
+    int maxIterations,
+    int output[]);
+
+//
+// The kernels below compute mandel() of mandelbrotSerial.cpp for 8 or 16
+// pixels of a row at once. They do the same float operations in the same
+// order, and the Makefile keeps the compiler from fusing multiplies and
+// adds, so every pixel gets exactly the count mandelbrotSerial() gives it.
+//
+// A lane stops counting once its pixel escaped, and a vector is done once
+// every lane escaped or ran maxIterations iterations. Lanes past the end
+// of the tile start out done and are never stored.
+//
+// With `accel` set they give the image of mandelbrotSerialAccel(), which
+// is the same one: lanes inside the main cardioid or the period-2 bulb
+// start out done with maxIterations, and so does a lane whose orbit comes
+// back to its saved point. All lanes save their point on the same
+// iterations.
+//
+
+// Iterations before the cycle check starts. Later than in
+// mandelbrotSerial.cpp, since a vector runs on until its last lane is
+// done, so stopping a few lanes early rarely saves any iterations.
+static constexpr int CYCLE_CHECK_AFTER = 128;
+
+typedef void (*TileKernel)(
+    float x0, float y0, float x1, float y1,
+    int width, int height,
+    int startCol, int numCols,
+    int startRow, int numRows,
+    int maxIterations,
+    int output[]);
+
+#ifdef HAVE_X86_KERNELS
+
+template <bool accel>
+__attribute__((target("avx2")))
+static void mandelbrotTileAvx2(
+    float x0, float y0, float x1, float y1,
+    int width, int height,
+    int startCol, int numCols,
+    int startRow, int numRows,
+    int maxIterations,
+    int output[])
+{
+    float dx = (x1 - x0) / width;
+    float dy = (y1 - y0) / height;
+
+    int endRow = std::min(startRow + numRows, height);
+    int endCol = std::min(startCol + numCols, width);
+
+    const __m256i lanes = _mm256_setr_epi32(0, 1, 2, 3, 4, 5, 6, 7);
+    const __m256i end = _mm256_set1_epi32(endCol);
+    const __m256 four = _mm256_set1_ps(4.f);
+    const __m256 two = _mm256_set1_ps(2.f);
+    const __m256 one = _mm256_set1_ps(1.f);
+    const __m256i maxCount = _mm256_set1_epi32(maxIterations);
+
+    for (int j = startRow; j < endRow; j++) {
+        __m256 c_im = _mm256_set1_ps(y0 + j * dy);
+        for (int i = startCol; i < endCol; i += 8) {
+            __m256i cols = _mm256_add_epi32(_mm256_set1_epi32(i), lanes);
+            __m256i inside = _mm256_cmpgt_epi32(end, cols);
+            __m256 c_re = _mm256_add_ps(_mm256_set1_ps(x0),
+                                        _mm256_mul_ps(_mm256_cvtepi32_ps(cols), _mm256_set1_ps(dx)));
+
+            __m256 z_re = c_re, z_im = c_im;
+            __m256 active = _mm256_castsi256_ps(inside);
+            __m256i count = _mm256_setzero_si256();
+            if (accel) {
+                __m256 xq = _mm256_sub_ps(c_re, _mm256_set1_ps(.25f));
+                __m256 q = _mm256_add_ps(_mm256_mul_ps(xq, xq), _mm256_mul_ps(c_im, c_im));
+                __m256 cardioid = _mm256_cmp_ps(
+                    _mm256_mul_ps(q, _mm256_add_ps(q, xq)),
+                    _mm256_mul_ps(_mm256_mul_ps(_mm256_set1_ps(.2495f), c_im), c_im), _CMP_LT_OQ);
+                __m256 re1 = _mm256_add_ps(c_re, one);
+                __m256 bulb = _mm256_cmp_ps(
+                    _mm256_add_ps(_mm256_mul_ps(re1, re1), _mm256_mul_ps(c_im, c_im)),
+                    _mm256_set1_ps(.0624f), _CMP_LT_OQ);
+                __m256 interior = _mm256_and_ps(_mm256_or_ps(cardioid, bulb), active);
+                count = _mm256_and_si256(maxCount, _mm256_castps_si256(interior));
+                active = _mm256_andnot_ps(interior, active);
+            }
+            __m256 saved_re = z_re, saved_im = z_im;
+            __m256 cycled = _mm256_setzero_ps();
+            int steps = 0, period = 1;
+            for (int k = 0; k < maxIterations; ++k) {
+                if (accel && k == CYCLE_CHECK_AFTER) {
+                    saved_re = z_re;
+                    saved_im = z_im;
+                }
+                __m256 re2 = _mm256_mul_ps(z_re, z_re);
+                __m256 im2 = _mm256_mul_ps(z_im, z_im);
+                __m256 escaped = _mm256_cmp_ps(_mm256_add_ps(re2, im2), four, _CMP_GT_OQ);
+                active = _mm256_andnot_ps(escaped, active);
+                if (_mm256_testz_ps(active, active))
+                    break;
+                // Active lanes are all ones, i.e. -1
+                count = _mm256_sub_epi32(count, _mm256_castps_si256(active));
+
+                __m256 new_re = _mm256_sub_ps(re2, im2);
+                __m256 new_im = _mm256_mul_ps(_mm256_mul_ps(two, z_re), z_im);
+                z_re = _mm256_add_ps(c_re, new_re);
+                z_im = _mm256_add_ps(c_im, new_im);
+
+                if (accel && k >= CYCLE_CHECK_AFTER) {
+                    __m256 cycle = _mm256_and_ps(
+                        _mm256_and_ps(_mm256_cmp_ps(z_re, saved_re, _CMP_EQ_OQ),
+                                      _mm256_cmp_ps(z_im, saved_im, _CMP_EQ_OQ)), active);
+                    cycled = _mm256_or_ps(cycled, cycle);
+                    active = _mm256_andnot_ps(cycle, active);
+                    if (++steps == period) {
+                        saved_re = z_re;
+                        saved_im = z_im;
+                        steps = 0;
+                        period *= 2;
+                    }
+                }
+            }
+            // Lanes whose orbit cycled never escape
+            if (accel)
+                count = _mm256_castps_si256(_mm256_blendv_ps(
+                    _mm256_castsi256_ps(count), _mm256_castsi256_ps(maxCount), cycled));
+            _mm256_maskstore_epi32(&output[j * width + i], inside, count);
+        }
+    }
+}
+
+template <bool accel>
+__attribute__((target("avx512f")))
+static void mandelbrotTileAvx512(
+    float x0, float y0, float x1, float y1,
+    int width, int height,
+    int startCol, int numCols,
+    int startRow, int numRows,
+    int maxIterations,
+    int output[])
+{
+    float dx = (x1 - x0) / width;
+    float dy = (y1 - y0) / height;
+
+    int endRow = std::min(startRow + numRows, height);
+    int endCol = std::min(startCol + numCols, width);
+
+    const __m512i lanes = _mm512_setr_epi32(0, 1, 2, 3, 4, 5, 6, 7,
+                                            8, 9, 10, 11, 12, 13, 14, 15);
+    const __m512i end = _mm512_set1_epi32(endCol);
+    const __m512i one = _mm512_set1_epi32(1);
+    const __m512 four = _mm512_set1_ps(4.f);
+    const __m512 two = _mm512_set1_ps(2.f);
+    const __m512i maxCount = _mm512_set1_epi32(maxIterations);
+
+    for (int j = startRow; j < endRow; j++) {
+        __m512 c_im = _mm512_set1_ps(y0 + j * dy);
+        for (int i = startCol; i < endCol; i += 16) {
+            __m512i cols = _mm512_add_epi32(_mm512_set1_epi32(i), lanes);
+            __mmask16 inside = _mm512_cmplt_epi32_mask(cols, end);
+            // Same as _mm512_cvtepi32_ps(), which trips -Wmaybe-uninitialized in GCC 12
+            __m512 colsf = _mm512_maskz_cvtepi32_ps(0xffff, cols);
+            __m512 c_re = _mm512_add_ps(_mm512_set1_ps(x0), _mm512_mul_ps(colsf, _mm512_set1_ps(dx)));
+
+            __m512 z_re = c_re, z_im = c_im;
+            __mmask16 active = inside;
+            __m512i count = _mm512_setzero_si512();
+            if (accel) {
+                __m512 xq = _mm512_sub_ps(c_re, _mm512_set1_ps(.25f));
+                __m512 q = _mm512_add_ps(_mm512_mul_ps(xq, xq), _mm512_mul_ps(c_im, c_im));
+                __mmask16 cardioid = _mm512_cmp_ps_mask(
+                    _mm512_mul_ps(q, _mm512_add_ps(q, xq)),
+                    _mm512_mul_ps(_mm512_mul_ps(_mm512_set1_ps(.2495f), c_im), c_im), _CMP_LT_OQ);
+                __m512 re1 = _mm512_add_ps(c_re, _mm512_set1_ps(1.f));
+                __mmask16 bulb = _mm512_cmp_ps_mask(
+                    _mm512_add_ps(_mm512_mul_ps(re1, re1), _mm512_mul_ps(c_im, c_im)),
+                    _mm512_set1_ps(.0624f), _CMP_LT_OQ);
+                __mmask16 interior = (cardioid | bulb) & active;
+                count = _mm512_mask_mov_epi32(count, interior, maxCount);
+                active &= ~interior;
+            }
+            __m512 saved_re = z_re, saved_im = z_im;
+            __mmask16 cycled = 0;
+            int steps = 0, period = 1;
+            for (int k = 0; k < maxIterations; ++k) {
+                if (accel && k == CYCLE_CHECK_AFTER) {
+                    saved_re = z_re;
+                    saved_im = z_im;
+                }
+                __m512 re2 = _mm512_mul_ps(z_re, z_re);
+                __m512 im2 = _mm512_mul_ps(z_im, z_im);
+                active &= ~_mm512_cmp_ps_mask(_mm512_add_ps(re2, im2), four, _CMP_GT_OQ);
+                if (!active)
+                    break;
+                count = _mm512_mask_add_epi32(count, active, count, one);
+
+                __m512 new_re = _mm512_sub_ps(re2, im2);
+                __m512 new_im = _mm512_mul_ps(_mm512_mul_ps(two, z_re), z_im);
+                z_re = _mm512_add_ps(c_re, new_re);
+                z_im = _mm512_add_ps(c_im, new_im);
+
+                if (accel && k >= CYCLE_CHECK_AFTER) {
+                    __mmask16 cycle = _mm512_cmp_ps_mask(z_re, saved_re, _CMP_EQ_OQ) &
+                                      _mm512_cmp_ps_mask(z_im, saved_im, _CMP_EQ_OQ) & active;
+                    cycled |= cycle;
+                    active &= ~cycle;
+                    if (++steps == period) {
+                        saved_re = z_re;
+                        saved_im = z_im;
+                        steps = 0;
+                        period *= 2;
+                    }
+                }
+            }
+            // Lanes whose orbit cycled never escape
+            count = _mm512_mask_mov_epi32(count, cycled, maxCount);
+            _mm512_mask_storeu_epi32(&output[j * width + i], inside, count);
+        }
+    }
+}
+
+#endif
+
+//
+// The widest kernels the CPU supports, picked once. MANDELBROT_ISA set to
+// avx512, avx2 or scalar asks for narrower ones, to compare them.
+//
+struct Kernels {
+    const char* isa;
+    TileKernel plain;
+    TileKernel accel;
+};
+
+static Kernels pickKernels() {
+    const char* want = getenv("MANDELBROT_ISA");
+#ifdef HAVE_X86_KERNELS
+    __builtin_cpu_init();
+    bool avx512 = __builtin_cpu_supports("avx512f");
+    bool avx2 = __builtin_cpu_supports("avx2");
+    if (want && strcmp(want, "avx512") != 0) {
+        avx512 = false;
+        if (strcmp(want, "avx2") != 0)
+            avx2 = false;
+    }
+    if (avx512)
+        return {"avx512", mandelbrotTileAvx512<false>, mandelbrotTileAvx512<true>};
+    if (avx2)
+        return {"avx2", mandelbrotTileAvx2<false>, mandelbrotTileAvx2<true>};
+#endif
+    (void)want;
+    return {"scalar", mandelbrotSerialTile, mandelbrotSerialAccelTile};
+}
+
+static const Kernels kernels = pickKernels();
+
+//
+// MandelbrotVectorIsa --
+//
+// The instruction set the vector kernels run on: avx512, avx2 or scalar.
+const char* mandelbrotVectorIsa() {
+    return kernels.isa;
+}
+
+//
+// MandelbrotVectorTile --
+//
+// mandelbrotSerialTile() on the widest vectors the CPU has.
+void mandelbrotVectorTile(
+    float x0, float y0, float x1, float y1,
+    int width, int height,
+    int startCol, int numCols,
+    int startRow, int numRows,
+    int maxIterations,
+    int output[])
+{
+    kernels.plain(x0, y0, x1, y1, width, height,
+                  startCol, numCols, startRow, numRows, maxIterations, output);
+}
+
+//
+// MandelbrotVectorAccelTile --
+//
+// mandelbrotSerialAccelTile() on the widest vectors the CPU has.
+void mandelbrotVectorAccelTile(
+    float x0, float y0, float x1, float y1,
+    int width, int height,
+    int startCol, int numCols,
+    int startRow, int numRows,
+    int maxIterations,
+    int output[])
+{
+    kernels.accel(x0, y0, x1, y1, width, height,
+                  startCol, numCols, startRow, numRows, maxIterations, output);
+}
+
+//
+// MandelbrotVector --
+//
+// mandelbrotSerial() on the widest vectors the CPU has.
+void mandelbrotVector(
+    float x0, float y0, float x1, float y1,
+    int width, int height,
+    int startRow, int totalRows,
+    int maxIterations,
+    int output[])
+{
+    kernels.plain(x0, y0, x1, y1, width, height,
+                  0, width, startRow, totalRows, maxIterations, output);
+}
+
+//
+// MandelbrotVectorAccel --
+//
+// mandelbrotSerialAccel() on the widest vectors the CPU has.
+void mandelbrotVectorAccel(
+    float x0, float y0, float x1, float y1,
+    int width, int height,
+    int startRow, int totalRows,
+    int maxIterations,
+    int output[])
+{
+    kernels.accel(x0, y0, x1, y1, width, height,
+                  0, width, startRow, totalRows, maxIterations, output);
+}
@@ -65,6 +65,7 @@ void usage(const char* progname) {
     printf("Program Options:\n");
     printf("  -t  --tasks        Run ISPC code implementation with tasks\n");
     printf("  -v  --view <INT>   Use specified view settings\n");
+    printf("  -a  --accel        Also run the ISPC code which skips interior points and periodic orbits\n");
     printf("  -?  --help         This message\n");
 }
 
@@ -81,17 +82,19 @@ int main(int argc, char** argv) {
     float y1 = 1;
 
     bool useTasks = false;
+    bool useAccel = false;
 
     // parse commandline options ////////////////////////////////////////////
     int opt;
     static struct option long_options[] = {
         {"tasks", 0, 0, 't'},
         {"view",  1, 0, 'v'},
+        {"accel", 0, 0, 'a'},
         {"help",  0, 0, '?'},
         {0 ,0, 0, 0}
     };
 
-    while ((opt = getopt_long(argc, argv, "tv:?", long_options, NULL)) != EOF) {
+    while ((opt = getopt_long(argc, argv, "tv:a?", long_options, NULL)) != EOF) {
 
         switch (opt) {
         case 't':
@@ -112,6 +115,9 @@ int main(int argc, char** argv) {
             }
             break;
         }
+        case 'a':
+            useAccel = true;
+            break;
         case '?':
         default:
             usage(argv[0]);
@@ -123,6 +129,7 @@ int main(int argc, char** argv) {
     int *output_serial = new int[width*height];
     int *output_ispc = new int[width*height];
     int *output_ispc_tasks = new int[width*height];
+    int *output_ispc_accel = new int[width*height];
 
     for (unsigned int i = 0; i < width * height; ++i)
         output_serial[i] = 0;
@@ -197,14 +204,44 @@ int main(int argc, char** argv) {
         }
     }
 
+    // Clear out the buffer
+    for (unsigned int i = 0; i < width * height; ++i) {
+        output_ispc_accel[i] = 0;
+    }
+
+    double minAccelISPC = 1e30;
+    if (useAccel) {
+        //
+        // Accelerated version of the ISPC code
+        //
+        for (int i = 0; i < 3; ++i) {
+            double startTime = CycleTimer::currentSeconds();
+            mandelbrot_ispc_accel(x0, y0, x1, y1, width, height, maxIterations, output_ispc_accel);
+            double endTime = CycleTimer::currentSeconds();
+            minAccelISPC = std::min(minAccelISPC, endTime - startTime);
+        }
+
+        printf("[mandelbrot accel ispc]:\t[%.3f] ms\n", minAccelISPC * 1000);
+        writePPMImage(output_ispc_accel, width, height, "mandelbrot-accel-ispc.ppm", maxIterations);
+
+        if (! verifyResult (output_serial, output_ispc_accel, width, height)) {
+            printf ("Error : ISPC output differs from sequential output\n");
+            return 1;
+        }
+    }
+
     printf("\t\t\t\t(%.2fx speedup from ISPC)\n", minSerial/minISPC);
     if (useTasks) {
         printf("\t\t\t\t(%.2fx speedup from task ISPC)\n", minSerial/minTaskISPC);
     }
+    if (useAccel) {
+        printf("\t\t\t\t(%.2fx speedup from accelerated ISPC)\n", minSerial/minAccelISPC);
+    }
 
     delete[] output_serial;
     delete[] output_ispc;
     delete[] output_ispc_tasks;
+    delete[] output_ispc_accel;
 
 
     return 0;
@@ -0,0 +1,183 @@
+#ifndef _AFFINITY_H
+#define _AFFINITY_H
+
+/*
+ * Placement of worker threads on CPUs, shared by the thread pools.
+ *
+ * The environment variable TASKSYS_AFFINITY selects the CPU of worker
+ * `i` of a pool:
+ *  - unset or "none": no pinning, the kernel places the workers.
+ *  - compact: the i-th CPU in topology order, so neighbouring workers
+ *    share a core first (SMT siblings), then a NUMA node.
+ *  - scatter: consecutive workers go to different NUMA nodes, and within
+ *    a node to different physical cores, so SMT siblings come last.
+ *  - a CPU list such as "0,2,4-7": the i-th CPU of the list.
+ * Workers beyond the number of CPUs wrap around. compact and scatter
+ * only use the CPUs in the affinity mask the process started with.
+ */
+
+#include <algorithm>
+#include <string>
+#include <vector>
+#include <ctype.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#ifdef __linux__
+#include <pthread.h>
+#include <sched.h>
+#endif
+
+/*
+ * Parse a kernel style CPU list, "0-3,8,10-11". Returns an empty list
+ * if `text` is not one.
+ */
+inline std::vector<int> parseCpuList(const std::string& text) {
+  std::vector<int> cpus;
+  size_t pos = 0;
+  while(pos < text.size()) {
+    size_t comma = text.find(',', pos);
+    if(comma == std::string::npos) comma = text.size();
+    std::string item = text.substr(pos, comma - pos);
+    pos = comma + 1;
+    while(!item.empty() && isspace((unsigned char)item.back())) item.pop_back();
+    if(item.empty()) continue;
+    char* rest = nullptr;
+    long first = strtol(item.c_str(), &rest, 10);
+    long last = first;
+    if(*rest == '-') last = strtol(rest + 1, &rest, 10);
+    if(*rest != '\0' || first < 0 || last < first) return {};
+    for(long cpu = first; cpu <= last; ++cpu) cpus.push_back((int)cpu);
+  }
+  return cpus;
+}
+
+#ifdef __linux__
+
+/*
+ * A number read from a sysfs file, -1 if there is none.
+ */
+inline int readSysfsInt(const std::string& path) {
+  FILE* file = fopen(path.c_str(), "r");
+  if(file == nullptr) return -1;
+  int value = -1;
+  if(fscanf(file, "%d", &value) != 1) value = -1;
+  fclose(file);
+  return value;
+}
+
+struct CpuPlace {
+  int cpu;
+  int node; // The NUMA node, or the socket where there are no nodes
+  int core; // Unique over the whole machine
+  int sibling; // 0 for the first hardware thread of its core, 1 for the next ...
+};
+
+/*
+ * The CPUs we may run on with their place in the topology.
+ */
+inline std::vector<CpuPlace> cpuTopology() {
+  std::vector<CpuPlace> places;
+  cpu_set_t allowed;
+  CPU_ZERO(&allowed);
+  if(sched_getaffinity(0, sizeof(allowed), &allowed) != 0) return places;
+
+  std::vector<int> node_of(CPU_SETSIZE, -1);
+  for(int node = 0; ; ++node) {
+    FILE* file = fopen(("/sys/devices/system/node/node" + std::to_string(node) + "/cpulist").c_str(), "r");
+    if(file == nullptr) break;
+    char line[4096] = {0};
+    if(fgets(line, sizeof(line), file) != nullptr) {
+      for(int cpu : parseCpuList(line)) {
+        if(cpu < CPU_SETSIZE) node_of[cpu] = node;
+      }
+    }
+    fclose(file);
+  }
+
+  for(int cpu = 0; cpu < CPU_SETSIZE; ++cpu) {
+    if(!CPU_ISSET(cpu, &allowed)) continue;
+    std::string topology = "/sys/devices/system/cpu/cpu" + std::to_string(cpu) + "/topology/";
+    int package = std::max(0, readSysfsInt(topology + "physical_package_id"));
+    int core = readSysfsInt(topology + "core_id");
+    int node = node_of[cpu] >= 0 ? node_of[cpu] : package;
+    places.push_back({cpu, node, core < 0 ? cpu : package * 65536 + core, 0});
+  }
+  for(auto& place : places) {
+    for(auto& other : places) {
+      if(other.cpu < place.cpu && other.core == place.core) place.sibling++;
+    }
+  }
+  return places;
+}
+
+/*
+ * The CPUs for workers 0, 1, 2 ... under the policy `policy`, empty for
+ * no pinning.
+ */
+inline std::vector<int> affinityCpus(const std::string& policy) {
+  std::vector<int> cpus;
+  if(policy.empty() || policy == "none") return cpus;
+  if(policy != "compact" && policy != "scatter") {
+    cpus = parseCpuList(policy);
+    if(cpus.empty()) {
+      fprintf(stderr, "Unknown TASKSYS_AFFINITY=%s, not pinning\n", policy.c_str());
+    }
+    return cpus;
+  }
+
+  std::vector<CpuPlace> places = cpuTopology();
+  if(policy == "compact") {
+    std::sort(places.begin(), places.end(), [](const CpuPlace& a, const CpuPlace& b) {
+      if(a.node != b.node) return a.node < b.node;
+      if(a.core != b.core) return a.core < b.core;
+      return a.cpu < b.cpu;
+    });
+    for(auto& place : places) cpus.push_back(place.cpu);
+    return cpus;
+  }
+
+  // scatter: order each node by sibling first, then deal the nodes out
+  // round robin.
+  std::sort(places.begin(), places.end(), [](const CpuPlace& a, const CpuPlace& b) {
+    if(a.node != b.node) return a.node < b.node;
+    if(a.sibling != b.sibling) return a.sibling < b.sibling;
+    if(a.core != b.core) return a.core < b.core;
+    return a.cpu < b.cpu;
+  });
+  std::vector<std::vector<int>> nodes;
+  for(size_t i = 0; i < places.size(); ++i) {
+    if(i == 0 || places[i].node != places[i - 1].node) nodes.emplace_back();
+    nodes.back().push_back(places[i].cpu);
+  }
+  for(size_t round = 0; cpus.size() < places.size(); ++round) {
+    for(auto& node : nodes) {
+      if(round < node.size()) cpus.push_back(node[round]);
+    }
+  }
+  return cpus;
+}
+
+#endif
+
+/*
+ * Pin the calling thread, worker `index` of its pool, as TASKSYS_AFFINITY
+ * asks. The policy is resolved once per process.
+ */
+inline void pinWorker(int index) {
+#ifdef __linux__
+  static const std::vector<int> cpus = []() {
+    const char* env = getenv("TASKSYS_AFFINITY");
+    return affinityCpus(env ? env : "");
+  }();
+  if(cpus.empty()) return;
+  int cpu = cpus[index % cpus.size()];
+  if(cpu >= CPU_SETSIZE) return;
+  cpu_set_t set;
+  CPU_ZERO(&set);
+  CPU_SET(cpu, &set);
+  pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+#endif
+}
+
+#endif
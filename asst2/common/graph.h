@@ -0,0 +1,115 @@
+#ifndef _GRAPH_H
+#define _GRAPH_H
+
+/*
+ * Capture of task graphs, shared by the task systems.
+ *
+ * Between beginCapture() and endCapture() a task system hands the calls
+ * to runAsyncWithDeps() to a GraphRecorder instead of running them. The
+ * recorded TaskGraph keeps everything a replay needs in flat arrays, so
+ * launchGraph() can walk it as often as it likes without allocating or
+ * looking anything up.
+ */
+
+#include <deque>
+#include <vector>
+#include "itasksys.h"
+
+/*
+ * TaskGraph: the launches of one capture, in submission order. A launch
+ * can only depend on launches recorded before it, so submission order
+ * is already a topological order. The dependencies and the successors of
+ * node `i` are the ranges [offsets[i], offsets[i + 1]) of `deps` and of
+ * `successors` respectively.
+ */
+struct TaskGraph {
+  struct Node {
+    IRunnable* runnable;
+    int num_total_tasks;
+    int priority;
+  };
+  std::vector<Node> nodes;
+  std::vector<int> dep_offsets {0};
+  std::vector<int> deps;
+  std::vector<int> succ_offsets;
+  std::vector<int> successors;
+  std::vector<int> roots; // Nodes without dependencies
+
+  int size() const {
+    return (int)nodes.size();
+  }
+
+  int numDeps(int node) const {
+    return dep_offsets[node + 1] - dep_offsets[node];
+  }
+
+  /*
+   * Build the successor lists and the roots once all nodes are recorded.
+   */
+  void finish() {
+    int n = size();
+    succ_offsets.assign(n + 1, 0);
+    for(int dep : deps) succ_offsets[dep + 1]++;
+    for(int i = 0; i < n; ++i) succ_offsets[i + 1] += succ_offsets[i];
+    successors.resize(deps.size());
+    std::vector<int> fill(succ_offsets.begin(), succ_offsets.end() - 1);
+    for(int i = 0; i < n; ++i) {
+      if(numDeps(i) == 0) roots.push_back(i);
+      for(int k = dep_offsets[i]; k < dep_offsets[i + 1]; ++k) {
+        successors[fill[deps[k]]++] = i;
+      }
+    }
+  }
+};
+
+/*
+ * GraphRecorder: the capture state of a task system and the graphs it
+ * captured. The identifiers returned while capturing are node indices,
+ * dependencies which do not name an earlier node of the same capture
+ * are dropped. Capturing is not meant to race with other submitters.
+ */
+class GraphRecorder {
+private:
+  bool capturing = false;
+  TaskGraph current;
+  std::deque<TaskGraph> graphs; // Never moves a graph once recorded
+
+public:
+  bool active() const {
+    return capturing;
+  }
+
+  void begin() {
+    current = TaskGraph();
+    capturing = true;
+  }
+
+  TaskID record(IRunnable* runnable, int num_total_tasks, const std::vector<TaskID>& deps,
+                int priority = 0) {
+    TaskID node = current.size();
+    current.nodes.push_back({runnable, num_total_tasks, priority});
+    for(TaskID dep : deps) {
+      if(dep >= 0 && dep < node) current.deps.push_back(dep);
+    }
+    current.dep_offsets.push_back((int)current.deps.size());
+    return node;
+  }
+
+  GraphID end() {
+    capturing = false;
+    current.finish();
+    graphs.push_back(std::move(current));
+    current = TaskGraph();
+    return (GraphID)graphs.size() - 1;
+  }
+
+  /*
+   * The graph behind a handle, nullptr for a handle we never returned.
+   */
+  const TaskGraph* graph(GraphID graph_id) const {
+    if(graph_id < 0 || graph_id >= (GraphID)graphs.size()) return nullptr;
+    return &graphs[graph_id];
+  }
+};
+
+#endif
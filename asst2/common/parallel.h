@@ -0,0 +1,114 @@
+#ifndef _PARALLEL_H
+#define _PARALLEL_H
+
+/*
+ * Loop front-end for the task systems.
+ *
+ * parallel_for() and parallel_reduce() split an index range into chunks
+ * of `grain` iterations and run one bulk task launch with a task per
+ * chunk. The loop body is a template parameter, so the only virtual call
+ * is the one runTask() per chunk, and the loop over a chunk is inlined
+ * into it where the compiler can vectorize it. No IRunnable subclass has
+ * to be written by hand.
+ *
+ * Both block until the loop is done, like ITaskSystem::run().
+ */
+
+#include <algorithm>
+#include <vector>
+#include "itasksys.h"
+
+template <typename Body>
+class ParallelForRunnable : public IRunnable {
+private:
+  int begin_;
+  int end_;
+  int grain_;
+  const Body& body_;
+
+public:
+  ParallelForRunnable(int begin, int end, int grain, const Body& body)
+    : begin_(begin), end_(end), grain_(grain), body_(body) {}
+
+  void runTask(int task_id, int num_total_tasks) {
+    int lo = begin_ + task_id * grain_;
+    int hi = std::min(lo + grain_, end_);
+    for(int i = lo; i < hi; ++i) {
+      body_(i);
+    }
+  }
+};
+
+/*
+ * Each chunk reduces into its own slot. The padding keeps the values of
+ * neighbouring slots on different cache lines, so chunks running on
+ * different workers never write to the same line.
+ */
+template <typename T>
+struct ReduceSlot {
+  T value;
+  char padding[64];
+};
+
+template <typename T, typename Body>
+class ParallelReduceRunnable : public IRunnable {
+private:
+  int begin_;
+  int end_;
+  int grain_;
+  const T& identity_;
+  const Body& body_;
+  std::vector<ReduceSlot<T>>& slots_;
+
+public:
+  ParallelReduceRunnable(int begin, int end, int grain, const T& identity, const Body& body,
+                         std::vector<ReduceSlot<T>>& slots)
+    : begin_(begin), end_(end), grain_(grain), identity_(identity), body_(body), slots_(slots) {}
+
+  void runTask(int task_id, int num_total_tasks) {
+    int lo = begin_ + task_id * grain_;
+    int hi = std::min(lo + grain_, end_);
+    slots_[task_id].value = body_(lo, hi, identity_);
+  }
+};
+
+inline int parallelChunks(int begin, int end, int& grain) {
+  grain = std::max(grain, 1);
+  if(end <= begin) return 0;
+  return (int)(((long long)end - begin + grain - 1) / grain);
+}
+
+/*
+ * Call `body(i)` for every i in [begin, end), `grain` iterations per task.
+ */
+template <typename Body>
+void parallel_for(ITaskSystem* system, int begin, int end, int grain, const Body& body) {
+  int chunks = parallelChunks(begin, end, grain);
+  if(chunks == 0) return;
+  ParallelForRunnable<Body> runnable(begin, end, grain, body);
+  system->run(&runnable, chunks);
+}
+
+/*
+ * Reduce [begin, end) in chunks of `grain` iterations. `body(lo, hi, acc)`
+ * folds the range [lo, hi) into `acc`, which starts as `identity`, and
+ * returns the result; `combine(a, b)` merges two partial results. The
+ * partial results are combined in index order, so the result does not
+ * depend on the schedule, even for floating point.
+ */
+template <typename T, typename Body, typename Combine>
+T parallel_reduce(ITaskSystem* system, int begin, int end, int grain, const T& identity,
+                  const Body& body, const Combine& combine) {
+  int chunks = parallelChunks(begin, end, grain);
+  if(chunks == 0) return identity;
+  std::vector<ReduceSlot<T>> slots(chunks);
+  ParallelReduceRunnable<T, Body> runnable(begin, end, grain, identity, body, slots);
+  system->run(&runnable, chunks);
+  T result = slots[0].value;
+  for(int i = 1; i < chunks; ++i) {
+    result = combine(result, slots[i].value);
+  }
+  return result;
+}
+
+#endif
@@ -0,0 +1,348 @@
+#ifndef _PARK_H
+#define _PARK_H
+
+/*
+ * Spin-then-park waiting shared by the thread pools.
+ *
+ * An idle worker first spins for a short budget, polling for work, since
+ * work often shows up again within microseconds. Once the budget is used
+ * up it registers itself as idle and parks on its own futex (or on a
+ * condition variable where there is no futex). A submitter wakes only as
+ * many idle workers as it has new work for, instead of broadcasting to
+ * the whole pool.
+ *
+ * The spin budget defaults to `default_spin_us` of the pool and can be
+ * overridden with the environment variable TASKSYS_SPIN_US. Setting
+ * TASKSYS_IDLE_REPORT prints the idle statistics when a pool is destroyed.
+ */
+
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <mutex>
+#include <thread>
+#include <vector>
+#include <stdio.h>
+#include <stdlib.h>
+#include "trace.h"
+
+#ifdef __linux__
+#include <linux/futex.h>
+#include <sys/syscall.h>
+#include <time.h>
+#include <unistd.h>
+#endif
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define TASKSYS_CPU_RELAX() _mm_pause()
+#elif defined(__aarch64__)
+#define TASKSYS_CPU_RELAX() asm volatile("yield")
+#else
+#define TASKSYS_CPU_RELAX() std::atomic_signal_fence(std::memory_order_seq_cst)
+#endif
+
+inline double parkNow() {
+  return std::chrono::duration<double>(
+    std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+/*
+ * Add to a time which other threads may read, or add to, meanwhile.
+ */
+inline void addSeconds(std::atomic<double>& total, double seconds) {
+  double old = total.load(std::memory_order_relaxed);
+  while(!total.compare_exchange_weak(old, old + seconds, std::memory_order_relaxed)) {
+  }
+}
+
+/*
+ * Parker: a binary semaphore for one waiting thread. unpark() before
+ * park() makes the next park() return at once, so a wakeup can never be
+ * lost between checking for work and going to sleep.
+ */
+class Parker {
+private:
+  std::atomic<int> permit {0};
+#ifndef __linux__
+  std::mutex mutex;
+  std::condition_variable cv;
+#endif
+public:
+  void park() {
+#ifdef __linux__
+    while(permit.exchange(0) == 0) {
+      syscall(SYS_futex, reinterpret_cast<int*>(&permit), FUTEX_WAIT_PRIVATE, 0, nullptr, nullptr, 0);
+    }
+#else
+    std::unique_lock<std::mutex> guard{mutex};
+    cv.wait(guard, [this]{ return permit.exchange(0) == 1; });
+#endif
+  }
+
+  /*
+   * Like park(), but give up after `timeout` seconds. Returns whether
+   * we were unparked.
+   */
+  bool park(double timeout) {
+#ifdef __linux__
+    double deadline = parkNow() + timeout;
+    while(permit.exchange(0) == 0) {
+      double left = deadline - parkNow();
+      if(left <= 0) return false;
+      struct timespec wait;
+      wait.tv_sec = (time_t)left;
+      wait.tv_nsec = (long)((left - (double)wait.tv_sec) * 1e9);
+      syscall(SYS_futex, reinterpret_cast<int*>(&permit), FUTEX_WAIT_PRIVATE, 0, &wait, nullptr, 0);
+    }
+    return true;
+#else
+    std::unique_lock<std::mutex> guard{mutex};
+    return cv.wait_for(guard, std::chrono::duration<double>(timeout),
+                       [this]{ return permit.exchange(0) == 1; });
+#endif
+  }
+
+  void unpark() {
+#ifdef __linux__
+    if(permit.exchange(1) == 0) {
+      syscall(SYS_futex, reinterpret_cast<int*>(&permit), FUTEX_WAKE_PRIVATE, 1, nullptr, nullptr, 0);
+    }
+#else
+    {
+      std::lock_guard<std::mutex> guard{mutex};
+      permit = 1;
+    }
+    cv.notify_one();
+#endif
+  }
+};
+
+/*
+ * Spin until `ready()` holds or `budget` seconds have passed. The clock is
+ * read once every 64 polls so that the spin budget is measured in real
+ * time whatever the speed of the poll. Returns whether `ready()` held,
+ * and adds the time spent to `spun`.
+ */
+template <typename Ready>
+bool spinUntil(Ready ready, double budget, double& spun) {
+  if(ready()) return true;
+  if(budget <= 0) return false;
+  double start = parkNow();
+  double now = start;
+  bool result = false;
+  for(int i = 1; ; ++i) {
+    if(ready()) {
+      result = true;
+      break;
+    }
+    TASKSYS_CPU_RELAX();
+    if((i & 63) == 0) {
+      now = parkNow();
+      if(now - start >= budget) break;
+    }
+  }
+  spun += parkNow() - start;
+  return result;
+}
+
+/*
+ * The spin budget in seconds, TASKSYS_SPIN_US overrides `default_us`.
+ * On a single hardware thread nobody can publish work while we spin, so
+ * the default budget drops to zero there.
+ */
+inline double spinBudget(double default_us) {
+  const char* env = getenv("TASKSYS_SPIN_US");
+  if(env) return atof(env) * 1e-6;
+  if(std::thread::hardware_concurrency() == 1) return 0;
+  return default_us * 1e-6;
+}
+
+/*
+ * IdleWorkers: the parkers of a pool's workers and the list of those
+ * which are parked (or about to park). Every worker has its own slot,
+ * padded to a cache line so that the statistics of one worker never
+ * share a line with another's.
+ */
+class IdleWorkers {
+private:
+  struct Slot {
+    Parker parker;
+    std::atomic<double> wake_start {0}; // When a submitter decided to wake us
+    std::atomic<double> spin_time {0}; // Seconds burned spinning while idle
+    std::atomic<double> park_time {0}; // Seconds spent parked
+    double wake_latency = 0; // Total seconds between wake() and running
+    long wakeups = 0;
+    char padding[64];
+  };
+  std::vector<Slot> slots;
+  std::mutex mutex; // guards `idle`
+  std::vector<int> idle;
+  double budget;
+
+  /*
+   * Take worker `index` off the idle list, returns false if a waker
+   * already did.
+   */
+  bool unregister(int index) {
+    std::lock_guard<std::mutex> guard{mutex};
+    for(size_t i = 0; i < idle.size(); ++i) {
+      if(idle[i] == index) {
+        idle[i] = idle.back();
+        idle.pop_back();
+        return true;
+      }
+    }
+    return false;
+  }
+
+public:
+  IdleWorkers(int num_workers, double default_spin_us)
+    : slots(num_workers), budget(spinBudget(default_spin_us)) {
+    idle.reserve(num_workers);
+  }
+
+  /*
+   * Called by worker `index` once it found no work: spin, then park until
+   * `ready()` may hold. `ready()` must become true before any call to
+   * wake() that is meant for this worker, which is how submitters publish
+   * their work.
+   *
+   * With a positive `linger` the worker parks for at most that many
+   * seconds. Returns false if it gave up without being woken, by then it
+   * is no longer registered as idle.
+   */
+  template <typename Ready>
+  bool wait(int index, Ready ready, double linger = 0) {
+    Slot& slot = slots[index];
+    double traced = traceClock();
+    double spun = 0;
+    bool spun_ready = spinUntil(ready, budget, spun);
+    if(spun > 0) addSeconds(slot.spin_time, spun);
+    if(spun_ready) {
+      traceComplete("spin", traced);
+      return true;
+    }
+    {
+      std::lock_guard<std::mutex> guard{mutex};
+      idle.push_back(index);
+    }
+    // Work published before we registered was not meant for us, so
+    // look once more before parking.
+    if(ready()) {
+      unregister(index);
+      return true;
+    }
+    traced = traceClock();
+    double start = parkNow();
+    if(linger <= 0) {
+      slot.parker.park();
+    } else if(!slot.parker.park(linger)) {
+      if(unregister(index)) {
+        traceComplete("park", traced);
+        addSeconds(slot.park_time, parkNow() - start);
+        return false;
+      }
+      // A waker took us off the list just as we timed out, its unpark()
+      // is on the way.
+      slot.parker.park();
+    }
+    traceComplete("park", traced);
+    double now = parkNow();
+    addSeconds(slot.park_time, now - start);
+    double wake_start = slot.wake_start.exchange(0);
+    if(wake_start != 0) {
+      slot.wake_latency += now - wake_start;
+      slot.wakeups++;
+    }
+    return true;
+  }
+
+  /*
+   * Wake up to `n` idle workers, returns how many were woken.
+   */
+  int wake(int n) {
+    int woken = 0;
+    while(woken < n) {
+      int index;
+      {
+        std::lock_guard<std::mutex> guard{mutex};
+        if(idle.empty()) break;
+        index = idle.back();
+        idle.pop_back();
+      }
+      slots[index].wake_start = parkNow();
+      slots[index].parker.unpark();
+      woken++;
+    }
+    return woken;
+  }
+
+  /*
+   * Wake every worker, parked or not. Used to shut a pool down.
+   */
+  void wakeAll() {
+    {
+      std::lock_guard<std::mutex> guard{mutex};
+      idle.clear();
+    }
+    for(auto& slot : slots) {
+      slot.parker.unpark();
+    }
+  }
+
+  double budgetSeconds() const {
+    return budget;
+  }
+
+  double spinSeconds() const {
+    double total = 0;
+    for(auto& slot : slots) total += slot.spin_time.load(std::memory_order_relaxed);
+    return total;
+  }
+
+  double parkSeconds() const {
+    double total = 0;
+    for(auto& slot : slots) total += slot.park_time.load(std::memory_order_relaxed);
+    return total;
+  }
+
+  /*
+   * The idle times of worker `index`, safe to read while it runs.
+   */
+  double spinSeconds(int index) const {
+    return slots[index].spin_time.load(std::memory_order_relaxed);
+  }
+
+  double parkSeconds(int index) const {
+    return slots[index].park_time.load(std::memory_order_relaxed);
+  }
+
+  long wakeups() const {
+    long total = 0;
+    for(auto& slot : slots) total += slot.wakeups;
+    return total;
+  }
+
+  double meanWakeLatency() const {
+    double total = 0;
+    for(auto& slot : slots) total += slot.wake_latency;
+    long count = wakeups();
+    return count ? total / count : 0;
+  }
+
+  /*
+   * Print the idle statistics if TASKSYS_IDLE_REPORT is set, `caller_spin`
+   * is the time spun by threads waiting for the pool. Must only be called
+   * once the workers have stopped.
+   */
+  void report(const char* name, double caller_spin) const {
+    if(!getenv("TASKSYS_IDLE_REPORT")) return;
+    fprintf(stderr, "%s: spin budget %.1f us, idle spinning %.3f ms (workers) + %.3f ms (callers), "
+            "parked %.3f ms, %ld wakeups, mean wake latency %.1f us\n",
+            name, budget * 1e6, spinSeconds() * 1e3, caller_spin * 1e3,
+            parkSeconds() * 1e3, wakeups(), meanWakeLatency() * 1e6);
+  }
+};
+
+#endif
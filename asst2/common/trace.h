@@ -0,0 +1,212 @@
+#ifndef _TRACE_H
+#define _TRACE_H
+
+/*
+ * Timeline tracing for the task systems.
+ *
+ * Every thread which records an event gets its own ring buffer, so
+ * recording never takes a lock after the first event of a thread. When
+ * a ring is full the oldest events are overwritten. traceWrite() exports
+ * every ring as Chrome trace JSON, which chrome://tracing and
+ * ui.perfetto.dev open directly.
+ *
+ * Tracing is off until traceStart() is called. While it is off, each
+ * trace point costs one relaxed load of a flag, so the trace points stay
+ * compiled into the task systems.
+ */
+
+#include <atomic>
+#include <chrono>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+#include <stdio.h>
+
+struct TraceEvent {
+  double ts; // Microseconds
+  double dur; // Microseconds, for complete events
+  const char* name;
+  char phase; // 'X' for a complete event, 'i' for an instant
+  int pid;
+  int launch; // -1 when not about a launch
+  int begin; // The task ids [begin, end), -1 when not about tasks
+  int end;
+};
+
+class TraceBuffer {
+private:
+  static const size_t CAPACITY = 1 << 16;
+  std::vector<TraceEvent> events;
+  size_t next = 0; // Where the next event goes once the ring is full
+
+public:
+  int tid;
+  std::string thread_name;
+
+  explicit TraceBuffer(int tid_) : tid(tid_) {}
+
+  void add(const TraceEvent& event) {
+    if(events.size() < CAPACITY) {
+      events.push_back(event);
+      return;
+    }
+    events[next] = event;
+    next = (next + 1) % CAPACITY;
+  }
+
+  // Oldest first
+  template <typename Visit>
+  void forEach(Visit visit) const {
+    for(size_t i = 0; i < events.size(); ++i) {
+      visit(events[(next + i) % events.size()]);
+    }
+  }
+};
+
+class Trace {
+private:
+  std::mutex mutex; // guards `buffers` and `processes`
+  std::vector<std::unique_ptr<TraceBuffer>> buffers;
+  std::vector<std::string> processes;
+  std::chrono::steady_clock::time_point origin = std::chrono::steady_clock::now();
+
+public:
+  std::atomic<bool> enabled {false};
+  std::atomic<int> pid {0};
+
+  static Trace& get() {
+    static Trace trace;
+    return trace;
+  }
+
+  double now() const {
+    return std::chrono::duration<double, std::micro>(std::chrono::steady_clock::now() - origin).count();
+  }
+
+  TraceBuffer* local() {
+    static thread_local TraceBuffer* buffer = nullptr;
+    if(buffer == nullptr) {
+      std::lock_guard<std::mutex> guard{mutex};
+      buffers.emplace_back(new TraceBuffer((int)buffers.size()));
+      buffer = buffers.back().get();
+    }
+    return buffer;
+  }
+
+  int newProcess(const std::string& name) {
+    std::lock_guard<std::mutex> guard{mutex};
+    processes.push_back(name);
+    pid = (int)processes.size() - 1;
+    return pid;
+  }
+
+  /*
+   * Must not race with threads recording events.
+   */
+  bool write(const char* path) {
+    FILE* file = fopen(path, "w");
+    if(file == nullptr) return false;
+    std::lock_guard<std::mutex> guard{mutex};
+    fprintf(file, "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[\n");
+    bool first = true;
+    auto separator = [&]() {
+      if(!first) fprintf(file, ",\n");
+      first = false;
+    };
+    for(size_t p = 0; p < processes.size(); ++p) {
+      separator();
+      fprintf(file, "{\"name\":\"process_name\",\"ph\":\"M\",\"pid\":%zu,\"args\":{\"name\":\"%s\"}}",
+              p, processes[p].c_str());
+    }
+    for(auto& buffer : buffers) {
+      std::vector<bool> named(processes.size() + 1, false);
+      buffer->forEach([&](const TraceEvent& event) {
+        if(!buffer->thread_name.empty() && event.pid < (int)named.size() && !named[event.pid]) {
+          named[event.pid] = true;
+          separator();
+          fprintf(file, "{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":%d,\"tid\":%d,\"args\":{\"name\":\"%s\"}}",
+                  event.pid, buffer->tid, buffer->thread_name.c_str());
+        }
+        separator();
+        fprintf(file, "{\"name\":\"%s\",\"ph\":\"%c\",\"ts\":%.3f,", event.name, event.phase, event.ts);
+        if(event.phase == 'X') {
+          fprintf(file, "\"dur\":%.3f,", event.dur);
+        } else {
+          fprintf(file, "\"s\":\"t\",");
+        }
+        fprintf(file, "\"pid\":%d,\"tid\":%d,\"args\":{", event.pid, buffer->tid);
+        const char* comma = "";
+        if(event.launch >= 0) {
+          fprintf(file, "\"launch\":%d", event.launch);
+          comma = ",";
+        }
+        if(event.begin >= 0) {
+          fprintf(file, "%s\"begin\":%d,\"end\":%d", comma, event.begin, event.end);
+        }
+        fprintf(file, "}}");
+      });
+    }
+    fprintf(file, "\n]}\n");
+    fclose(file);
+    return true;
+  }
+};
+
+inline bool traceOn() {
+  return Trace::get().enabled.load(std::memory_order_relaxed);
+}
+
+/*
+ * The start time to pass to traceComplete(), 0 while tracing is off.
+ */
+inline double traceClock() {
+  return traceOn() ? Trace::get().now() : 0;
+}
+
+/*
+ * Record an event which lasted from `start` until now, nothing if
+ * `start` is 0 because tracing was off when it began.
+ */
+inline void traceComplete(const char* name, double start, int launch = -1, int begin = -1, int end = -1) {
+  if(start == 0) return;
+  Trace& trace = Trace::get();
+  double now = trace.now();
+  trace.local()->add({start, now - start, name, 'X', trace.pid.load(std::memory_order_relaxed),
+                      launch, begin, end});
+}
+
+inline void traceInstant(const char* name, int launch = -1) {
+  if(!traceOn()) return;
+  Trace& trace = Trace::get();
+  trace.local()->add({trace.now(), 0, name, 'i', trace.pid.load(std::memory_order_relaxed),
+                      launch, -1, -1});
+}
+
+/*
+ * Name the calling thread in the timeline.
+ */
+inline void traceThreadName(const std::string& name) {
+  if(!traceOn()) return;
+  Trace::get().local()->thread_name = name;
+}
+
+/*
+ * Start tracing. Events recorded after traceProcess() are shown under
+ * a process called `name`, which is how runtasks separates the runs of
+ * different task systems.
+ */
+inline void traceStart() {
+  Trace::get().enabled = true;
+}
+
+inline void traceProcess(const std::string& name) {
+  if(!traceOn()) return;
+  Trace::get().newProcess(name);
+}
+
+inline bool traceWrite(const char* path) {
+  return Trace::get().write(path);
+}
+
+#endif
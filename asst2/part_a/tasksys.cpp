@@ -6,6 +6,17 @@ IRunnable::~IRunnable() {}
 ITaskSystem::ITaskSystem(int num_threads) {}
 ITaskSystem::~ITaskSystem() {}
 
+TaskID ITaskSystem::runAsyncWithDeps(IRunnable* runnable, int num_total_tasks,
+                                     const std::vector<TaskID>& deps, int priority) {
+    return runAsyncWithDeps(runnable, num_total_tasks, deps);
+}
+
+void ITaskSystem::setConcurrency(int num_threads) {}
+
+TaskSystemStats ITaskSystem::stats() {
+    return TaskSystemStats();
+}
+
 /*
  * ================================================================
  * Serial task system implementation
@@ -36,6 +47,30 @@ void TaskSystemSerial::sync() {
   return;
 }
 
+void TaskSystemSerial::wait(TaskID task_id) {
+  return;
+}
+
+bool TaskSystemSerial::isDone(TaskID task_id) {
+  return true;
+}
+
+TaskID TaskSystemSerial::waitAny(const std::vector<TaskID>& task_ids) {
+  return task_ids.empty() ? -1 : task_ids[0];
+}
+
+void TaskSystemSerial::beginCapture() {
+  return;
+}
+
+GraphID TaskSystemSerial::endCapture() {
+  return 0;
+}
+
+void TaskSystemSerial::launchGraph(GraphID graph) {
+  return;
+}
+
 /*
  * ================================================================
  * Parallel Task System Implementation
@@ -53,6 +88,7 @@ TaskSystemParallelSpawn::~TaskSystemParallelSpawn() {}
 
 void TaskSystemParallelSpawn::run(IRunnable* runnable, int num_total_tasks) {
   auto thread_func = [runnable_ = runnable, num = _num_threads, total = num_total_tasks](int i) {
+    pinWorker(i);
     while(i < total) {
       runnable_->runTask(i, total);
       i += num;
@@ -76,6 +112,55 @@ void TaskSystemParallelSpawn::sync() {
   return;
 }
 
+void TaskSystemParallelSpawn::wait(TaskID task_id) {
+  return;
+}
+
+bool TaskSystemParallelSpawn::isDone(TaskID task_id) {
+  return true;
+}
+
+TaskID TaskSystemParallelSpawn::waitAny(const std::vector<TaskID>& task_ids) {
+  return task_ids.empty() ? -1 : task_ids[0];
+}
+
+void TaskSystemParallelSpawn::beginCapture() {
+  return;
+}
+
+GraphID TaskSystemParallelSpawn::endCapture() {
+  return 0;
+}
+
+void TaskSystemParallelSpawn::launchGraph(GraphID graph) {
+  return;
+}
+
+/*
+ * Both thread pools share the same bulk launch engine. A launch is
+ * published by bumping `generation` and rewinding the shared task cursor
+ * `next`. Workers join the launch under `queue_mutex` (so they read a
+ * consistent runnable and task count), claim task ids from the cursor
+ * until it runs past the end, and leave. The launch is complete once the
+ * cursor is exhausted and no worker is left inside it. Nothing here
+ * depends on the number of workers, and a slow task only delays the
+ * worker running it, the others keep claiming ids.
+ *
+ * They also share the waiting policy of park.h: idle workers and the
+ * thread blocked in run() spin for a short budget and then park. The two
+ * pools only differ in how long they spin by default.
+ */
+static const double SPINNING_SPIN_US = 500;
+static const double SLEEPING_SPIN_US = 50;
+
+static void runClaimedTasks(std::atomic<int>& next, IRunnable* runnable, int total_tasks, int launch) {
+  for(int i = next.fetch_add(1); i < total_tasks; i = next.fetch_add(1)) {
+    double traced = traceClock();
+    runnable->runTask(i, total_tasks);
+    traceComplete("tasks", traced, launch, i, i + 1);
+  }
+}
+
 /*
  * ================================================================
  * Parallel Thread Pool Spinning Task System Implementation
@@ -87,25 +172,17 @@ const char* TaskSystemParallelThreadPoolSpinning::name() {
 }
 
 TaskSystemParallelThreadPoolSpinning::TaskSystemParallelThreadPoolSpinning(int num_threads)
-  : ITaskSystem(num_threads), _num_threads(num_threads) {
-  unsigned int init = 0x01;
-  for(int i = 0; i < _num_threads; ++i) {
-    bitmap_init_value |= init;
-    init <<= 1;
-  }
+  : ITaskSystem(num_threads), _num_threads(num_threads), idle(num_threads, SPINNING_SPIN_US) {
   start(_num_threads);
 }
 
 TaskSystemParallelThreadPoolSpinning::~TaskSystemParallelThreadPoolSpinning() {
-  /*
-    * Here, we don't need to synchronize the code, because
-    * the thread will never write `terminate`. No matter
-    * the thread may read some corrupted value, this doesn't matter.
-  */
   terminate = true;
+  idle.wakeAll();
   for(int i = 0; i < _num_threads; ++i) {
     threads[i].join();
   }
+  idle.report(name(), caller_spin);
 }
 
 void TaskSystemParallelThreadPoolSpinning::start(int num_threads) {
@@ -116,43 +193,58 @@ void TaskSystemParallelThreadPoolSpinning::start(int num_threads) {
 }
 
 void TaskSystemParallelThreadPoolSpinning::threadLoop(int i) {
-  while(true && !terminate) {
-    bool flag = false;
+  traceThreadName("worker " + std::to_string(i));
+  pinWorker(i);
+  unsigned long seen = 0;
+  while(!terminate) {
+    if(generation.load() == seen) {
+      idle.wait(i, [&]{ return terminate || generation.load() != seen; });
+      continue;
+    }
+    IRunnable* runnable = nullptr;
+    int total = 0;
     {
       std::lock_guard<std::mutex> guard{queue_mutex};
-      flag = (jobs >> i) & 0x01;
+      seen = generation.load();
+      // A launch which is already exhausted may be over, and the
+      // caller may be about to publish the next one. Don't join it.
+      if(next.load() >= total_tasks) continue;
+      runnable = runnable_;
+      total = total_tasks;
+      active++;
     }
-    if(flag) {
-      int taskId = i;
-      while(taskId < total_tasks) {
-        runnable_->runTask(taskId, total_tasks);
-        taskId += _num_threads;
-      }
-      {
-        std::lock_guard<std::mutex> guard{queue_mutex};
-        jobs &= ~(0x01 << i);
+    runClaimedTasks(next, runnable, total, (int)seen);
+    {
+      std::lock_guard<std::mutex> guard{queue_mutex};
+      active--;
+      if(active == 0) {
+        caller.unpark();
       }
     }
   }
 }
 
 bool TaskSystemParallelThreadPoolSpinning::busy() {
-  bool poolbusy;
-  {
-    std::lock_guard<std::mutex> guard{queue_mutex};
-    poolbusy = jobs;
-  }
-  return poolbusy;
+  if(next.load() < total_tasks) return true;
+  std::lock_guard<std::mutex> guard{queue_mutex};
+  return active != 0;
 }
 
 void TaskSystemParallelThreadPoolSpinning::run(IRunnable* runnable, int num_total_tasks) {
-  total_tasks = num_total_tasks;
-  runnable_ = runnable;
   {
     std::lock_guard<std::mutex> guard{queue_mutex};
-    jobs = bitmap_init_value;
+    total_tasks = num_total_tasks;
+    runnable_ = runnable;
+    next = 0;
+    generation++;
   }
-  while(busy());
+  traceInstant("submit", (int)generation.load());
+  idle.wake(std::min(num_total_tasks, _num_threads));
+  double traced = traceClock();
+  while(!spinUntil([this]{ return !busy(); }, idle.budgetSeconds(), caller_spin)) {
+    caller.park();
+  }
+  traceComplete("sync", traced);
 }
 
 TaskID TaskSystemParallelThreadPoolSpinning::runAsyncWithDeps(IRunnable* runnable, int num_total_tasks,
@@ -164,6 +256,30 @@ void TaskSystemParallelThreadPoolSpinning::sync() {
   return;
 }
 
+void TaskSystemParallelThreadPoolSpinning::wait(TaskID task_id) {
+  return;
+}
+
+bool TaskSystemParallelThreadPoolSpinning::isDone(TaskID task_id) {
+  return true;
+}
+
+TaskID TaskSystemParallelThreadPoolSpinning::waitAny(const std::vector<TaskID>& task_ids) {
+  return task_ids.empty() ? -1 : task_ids[0];
+}
+
+void TaskSystemParallelThreadPoolSpinning::beginCapture() {
+  return;
+}
+
+GraphID TaskSystemParallelThreadPoolSpinning::endCapture() {
+  return 0;
+}
+
+void TaskSystemParallelThreadPoolSpinning::launchGraph(GraphID graph) {
+  return;
+}
+
 /*
  * ================================================================
  * Parallel Thread Pool Sleeping Task System Implementation
@@ -175,26 +291,17 @@ const char* TaskSystemParallelThreadPoolSleeping::name() {
 }
 
 TaskSystemParallelThreadPoolSleeping::TaskSystemParallelThreadPoolSleeping(int num_threads)
-  : ITaskSystem(num_threads), _num_threads(num_threads) {
-  unsigned int init = 0x01;
-  for(int i = 0; i < _num_threads; ++i) {
-    bitmap_init_value |= init;
-    init <<= 1;
-  }
+  : ITaskSystem(num_threads), _num_threads(num_threads), idle(num_threads, SLEEPING_SPIN_US) {
   start(_num_threads);
 }
 
 TaskSystemParallelThreadPoolSleeping::~TaskSystemParallelThreadPoolSleeping() {
-  /*
-    * Here, we don't need to synchronize the code, because
-    * the thread will never write `terminate`. No matter
-    * the thread may read some corrupted value, this doesn't matter.
-  */
   terminate = true;
-  producer.notify_all();
+  idle.wakeAll();
   for(int i = 0; i < _num_threads; ++i) {
     threads[i].join();
   }
+  idle.report(name(), caller_spin);
 }
 
 void TaskSystemParallelThreadPoolSleeping::start(int num_threads) {
@@ -205,52 +312,56 @@ void TaskSystemParallelThreadPoolSleeping::start(int num_threads) {
 }
 
 void TaskSystemParallelThreadPoolSleeping::threadLoop(int i) {
-  while(true) {
-    {
-      std::unique_lock<std::mutex> guard{queue_mutex};
-      if(((jobs >> i) & 0x01)== 0) {
-        producer.wait(guard);
-      }
+  traceThreadName("worker " + std::to_string(i));
+  pinWorker(i);
+  unsigned long seen = 0;
+  while(!terminate) {
+    if(generation.load() == seen) {
+      idle.wait(i, [&]{ return terminate || generation.load() != seen; });
+      continue;
     }
-    if(terminate) return;
-    int taskId = i;
-    while(taskId < total_tasks) {
-      runnable_->runTask(taskId, total_tasks);
-      taskId += _num_threads;
+    IRunnable* runnable = nullptr;
+    int total = 0;
+    {
+      std::lock_guard<std::mutex> guard{queue_mutex};
+      seen = generation.load();
+      if(next.load() >= total_tasks) continue;
+      runnable = runnable_;
+      total = total_tasks;
+      active++;
     }
+    runClaimedTasks(next, runnable, total, (int)seen);
     {
       std::lock_guard<std::mutex> guard{queue_mutex};
-      jobs &= ~(0x01 << i);
-      if(jobs == 0) {
-        consumer.notify_one();
+      active--;
+      if(active == 0) {
+        caller.unpark();
       }
     }
   }
 }
 
 bool TaskSystemParallelThreadPoolSleeping::busy() {
-  bool poolbusy;
-  {
-    std::lock_guard<std::mutex> guard{queue_mutex};
-    poolbusy = jobs;
-  }
-  return poolbusy;
+  if(next.load() < total_tasks) return true;
+  std::lock_guard<std::mutex> guard{queue_mutex};
+  return active != 0;
 }
 
 void TaskSystemParallelThreadPoolSleeping::run(IRunnable* runnable, int num_total_tasks) {
-  total_tasks = num_total_tasks;
-  runnable_ = runnable;
   {
     std::lock_guard<std::mutex> guard{queue_mutex};
-    jobs = bitmap_init_value;
+    total_tasks = num_total_tasks;
+    runnable_ = runnable;
+    next = 0;
+    generation++;
   }
-  producer.notify_all();
-  {
-    std::unique_lock<std::mutex> guard{queue_mutex};
-    if(jobs != 0) {
-      consumer.wait(guard);
-    }
+  traceInstant("submit", (int)generation.load());
+  idle.wake(std::min(num_total_tasks, _num_threads));
+  double traced = traceClock();
+  while(!spinUntil([this]{ return !busy(); }, idle.budgetSeconds(), caller_spin)) {
+    caller.park();
   }
+  traceComplete("sync", traced);
 }
 
 TaskID TaskSystemParallelThreadPoolSleeping::runAsyncWithDeps(IRunnable* runnable, int num_total_tasks,
@@ -261,3 +372,27 @@ TaskID TaskSystemParallelThreadPoolSleeping::runAsyncWithDeps(IRunnable* runnabl
 void TaskSystemParallelThreadPoolSleeping::sync() {
   return;
 }
+
+void TaskSystemParallelThreadPoolSleeping::wait(TaskID task_id) {
+  return;
+}
+
+bool TaskSystemParallelThreadPoolSleeping::isDone(TaskID task_id) {
+  return true;
+}
+
+TaskID TaskSystemParallelThreadPoolSleeping::waitAny(const std::vector<TaskID>& task_ids) {
+  return task_ids.empty() ? -1 : task_ids[0];
+}
+
+void TaskSystemParallelThreadPoolSleeping::beginCapture() {
+  return;
+}
+
+GraphID TaskSystemParallelThreadPoolSleeping::endCapture() {
+  return 0;
+}
+
+void TaskSystemParallelThreadPoolSleeping::launchGraph(GraphID graph) {
+  return;
+}
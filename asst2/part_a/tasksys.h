@@ -1,11 +1,15 @@
 #ifndef _TASKSYS_H
 #define _TASKSYS_H
 
+#include <atomic>
 #include <thread>
 #include <mutex>
 #include <vector>
 #include <condition_variable>
 #include "itasksys.h"
+#include "affinity.h"
+#include "park.h"
+#include "trace.h"
 
 /*
  * TaskSystemSerial: This class is the student's implementation of a
@@ -21,6 +25,12 @@ public:
   TaskID runAsyncWithDeps(IRunnable* runnable, int num_total_tasks,
                           const std::vector<TaskID>& deps);
   void sync();
+  void wait(TaskID task_id);
+  bool isDone(TaskID task_id);
+  TaskID waitAny(const std::vector<TaskID>& task_ids);
+  void beginCapture();
+  GraphID endCapture();
+  void launchGraph(GraphID graph);
 };
 
 /*
@@ -40,6 +50,12 @@ class TaskSystemParallelSpawn: public ITaskSystem {
     TaskID runAsyncWithDeps(IRunnable* runnable, int num_total_tasks,
                             const std::vector<TaskID>& deps);
     void sync();
+    void wait(TaskID task_id);
+    bool isDone(TaskID task_id);
+    TaskID waitAny(const std::vector<TaskID>& task_ids);
+    void beginCapture();
+    GraphID endCapture();
+    void launchGraph(GraphID graph);
 };
 
 /*
@@ -52,15 +68,19 @@ class TaskSystemParallelThreadPoolSpinning: public ITaskSystem {
 private:
   int _num_threads; // to store the threads
   std::vector<std::thread> threads; // thread poll
-  unsigned int jobs = 0x00; // bitmap value for indicating whether there is a job
-  unsigned int bitmap_init_value = 0x00; // initialized bitmap value with 0x1111
-  IRunnable* runnable_; // we need to record the runnable
+  std::atomic<unsigned long> generation {0}; // bumped by every launch
+  std::atomic<int> next {0}; // the next task id to be claimed
+  int active = 0; // workers which joined the current launch
+  IRunnable* runnable_ = nullptr; // we need to record the runnable
   std::mutex queue_mutex; // the big lock
-  bool terminate = false; // Whether we should terminate the thread
+  std::atomic<bool> terminate {false}; // Whether we should terminate the thread
   int total_tasks = 0;    // we should record the total task
+  IdleWorkers idle; // spin-then-park waiting of the workers
+  Parker caller; // the thread waiting in run()
+  double caller_spin = 0; // seconds the caller spun in run()
   void start(int num_threads); // start the thread pool
   void threadLoop(int i); // thread functionaility
-  bool busy(); // whether the threads are busy doing their jobs
+  bool busy(); // whether the current launch is still running
 public:
   TaskSystemParallelThreadPoolSpinning(int num_threads);
   ~TaskSystemParallelThreadPoolSpinning();
@@ -69,6 +89,12 @@ public:
   TaskID runAsyncWithDeps(IRunnable* runnable, int num_total_tasks,
                           const std::vector<TaskID>& deps);
   void sync();
+  void wait(TaskID task_id);
+  bool isDone(TaskID task_id);
+  TaskID waitAny(const std::vector<TaskID>& task_ids);
+  void beginCapture();
+  GraphID endCapture();
+  void launchGraph(GraphID graph);
 };
 
 /*
@@ -81,17 +107,19 @@ class TaskSystemParallelThreadPoolSleeping: public ITaskSystem {
 private:
   int _num_threads; // to store the threads
   std::vector<std::thread> threads; // thread poll
-  unsigned int jobs = 0x00; // bitmap value for indicating whether there is a job
-  unsigned int bitmap_init_value = 0x00; // initialized bitmap value with 0x1111
-  IRunnable* runnable_; // we need to record the runnable
+  std::atomic<unsigned long> generation {0}; // bumped by every launch
+  std::atomic<int> next {0}; // the next task id to be claimed
+  int active = 0; // workers which joined the current launch
+  IRunnable* runnable_ = nullptr; // we need to record the runnable
   std::mutex queue_mutex; // the big lock
-  std::condition_variable consumer; // the condition variable
-  std::condition_variable producer; // the condition variable
-  bool terminate = false; // Whether we should terminate the thread
+  std::atomic<bool> terminate {false}; // Whether we should terminate the thread
   int total_tasks = 0;    // we should record the total task
+  IdleWorkers idle; // spin-then-park waiting of the workers
+  Parker caller; // the thread waiting in run()
+  double caller_spin = 0; // seconds the caller spun in run()
   void start(int num_threads); // start the thread pool
   void threadLoop(int i); // thread functionaility
-  bool busy(); // whether the threads are busy doing their jobs
+  bool busy(); // whether the current launch is still running
 public:
   TaskSystemParallelThreadPoolSleeping(int num_threads);
   ~TaskSystemParallelThreadPoolSleeping();
@@ -100,6 +128,12 @@ public:
   TaskID runAsyncWithDeps(IRunnable* runnable, int num_total_tasks,
                                 const std::vector<TaskID>& deps);
   void sync();
+  void wait(TaskID task_id);
+  bool isDone(TaskID task_id);
+  TaskID waitAny(const std::vector<TaskID>& task_ids);
+  void beginCapture();
+  GraphID endCapture();
+  void launchGraph(GraphID graph);
 };
 
 #endif
@@ -0,0 +1,203 @@
+#ifndef _CORO_H
+#define _CORO_H
+
+/*
+ * Coroutine front-end for the sleeping thread pool, needs C++20.
+ *
+ * A multi-stage pipeline is written as a coroutine returning Pipeline,
+ * which awaits its launches instead of threading TaskIDs through by hand:
+ *
+ *   Pipeline stages(CoTaskSystem& ts, Data* data) {
+ *     co_await ts.launch(&data->first, 64);
+ *     co_await ts.launch(&data->second, 64);
+ *   }
+ *   ts.spawn(stages(ts, data));
+ *   ts.sync();
+ *
+ * A suspended pipeline holds no thread. Awaiting submits the launch and,
+ * behind it, a continuation: a launch of one task which depends on the
+ * awaited work and resumes the coroutine when it runs. So the coroutine
+ * is always resumed by a pool worker, which returns to the pool at the
+ * next co_await, and thousands of pipelines can share a few workers.
+ * Since a pipeline always has a launch outstanding until it returns,
+ * sync() waits for the pipelines as well as for the launches.
+ *
+ * The code between two co_awaits runs inside a task of the pool, so it
+ * must not call sync() or wait() of the pool for work outside the
+ * pipeline, and should stay short. Pipelines are not meant to be
+ * started while a graph is being captured.
+ */
+
+#if __cplusplus < 202002L
+#error "coro.h needs C++20, build with -std=c++20"
+#endif
+
+#include <coroutine>
+#include <exception>
+#include <utility>
+#include <vector>
+#include "tasksys.h"
+
+/*
+ * ResumeRunnable: the single task of a continuation, resumes `handle`.
+ * The coroutine may finish and free us during resume(), which is fine
+ * since the pool does not touch a runnable once its last task returned.
+ */
+class ResumeRunnable : public IRunnable {
+public:
+  std::coroutine_handle<> handle;
+
+  void runTask(int task_id, int num_total_tasks) {
+    handle.resume();
+  }
+};
+
+/*
+ * Pipeline: the return type of a coroutine run by CoTaskSystem. It starts
+ * suspended and does nothing until it is handed to CoTaskSystem::spawn().
+ * Its frame frees itself when the coroutine returns.
+ */
+class Pipeline {
+public:
+  struct promise_type {
+    // A pipeline awaits one thing at a time, so one continuation
+    // runnable serves all its suspensions.
+    ResumeRunnable resumer;
+
+    Pipeline get_return_object() {
+      return Pipeline(std::coroutine_handle<promise_type>::from_promise(*this));
+    }
+    std::suspend_always initial_suspend() noexcept { return {}; }
+    std::suspend_never final_suspend() noexcept { return {}; }
+    void return_void() {}
+    void unhandled_exception() { std::terminate(); }
+  };
+
+  explicit Pipeline(std::coroutine_handle<promise_type> handle_) : handle(handle_) {}
+  Pipeline(Pipeline&& other) noexcept : handle(std::exchange(other.handle, nullptr)) {}
+  Pipeline(const Pipeline&) = delete;
+  Pipeline& operator=(const Pipeline&) = delete;
+  ~Pipeline() {
+    if(handle) handle.destroy();
+  }
+
+  // Give up the coroutine, whoever takes it starts it.
+  std::coroutine_handle<promise_type> release() {
+    return std::exchange(handle, nullptr);
+  }
+
+private:
+  std::coroutine_handle<promise_type> handle;
+};
+
+class CoTaskSystem {
+private:
+  TaskSystemParallelThreadPoolSleeping& system_;
+
+  /*
+   * Resume the pipeline `handle` on a worker once `deps` are done. Must be
+   * the last thing an awaiter does, since the pipeline may run (and be
+   * freed) before this returns.
+   */
+  void resumeAfter(std::coroutine_handle<Pipeline::promise_type> handle,
+                   const std::vector<TaskID>& deps) {
+    ResumeRunnable& resumer = handle.promise().resumer;
+    resumer.handle = handle;
+    system_.runAsyncWithDeps(&resumer, 1, deps);
+  }
+
+public:
+  /*
+   * The result of launch(): co_await submits the launch and resumes the
+   * pipeline once it is done, giving the TaskID of the launch.
+   */
+  class LaunchAwaiter {
+  private:
+    CoTaskSystem& ts;
+    IRunnable* runnable;
+    int num_total_tasks;
+    std::vector<TaskID> deps;
+    TaskID task_id = -1;
+
+  public:
+    LaunchAwaiter(CoTaskSystem& ts_, IRunnable* runnable_, int num_total_tasks_,
+                  std::vector<TaskID> deps_)
+      : ts(ts_), runnable(runnable_), num_total_tasks(num_total_tasks_), deps(std::move(deps_)) {}
+
+    bool await_ready() const noexcept { return false; }
+
+    void await_suspend(std::coroutine_handle<Pipeline::promise_type> handle) {
+      task_id = ts.system_.runAsyncWithDeps(runnable, num_total_tasks, deps);
+      ts.resumeAfter(handle, {task_id});
+    }
+
+    TaskID await_resume() const noexcept { return task_id; }
+  };
+
+  /*
+   * The result of after(): co_await resumes the pipeline once every one
+   * of the launches is done, at once if there are none.
+   */
+  class AfterAwaiter {
+  private:
+    CoTaskSystem& ts;
+    std::vector<TaskID> deps;
+
+  public:
+    AfterAwaiter(CoTaskSystem& ts_, std::vector<TaskID> deps_) : ts(ts_), deps(std::move(deps_)) {}
+
+    bool await_ready() const noexcept { return deps.empty(); }
+
+    void await_suspend(std::coroutine_handle<Pipeline::promise_type> handle) {
+      ts.resumeAfter(handle, deps);
+    }
+
+    void await_resume() const noexcept {}
+  };
+
+  explicit CoTaskSystem(TaskSystemParallelThreadPoolSleeping& system) : system_(system) {}
+
+  /*
+   * A bulk launch of `num_total_tasks` tasks of `runnable` after `deps`,
+   * to co_await. `runnable` must live until the launch is done, a local
+   * of the pipeline does.
+   */
+  LaunchAwaiter launch(IRunnable* runnable, int num_total_tasks, std::vector<TaskID> deps = {}) {
+    return LaunchAwaiter(*this, runnable, num_total_tasks, std::move(deps));
+  }
+
+  /*
+   * Wait for launches submitted without awaiting them, to fan out a stage
+   * with submit() and join it here.
+   */
+  AfterAwaiter after(std::vector<TaskID> deps) {
+    return AfterAwaiter(*this, std::move(deps));
+  }
+
+  /*
+   * Submit a launch without suspending.
+   */
+  TaskID submit(IRunnable* runnable, int num_total_tasks, const std::vector<TaskID>& deps = {}) {
+    return system_.runAsyncWithDeps(runnable, num_total_tasks, deps);
+  }
+
+  /*
+   * Start `pipeline` on a worker. Any thread may spawn, a pipeline too.
+   */
+  void spawn(Pipeline pipeline) {
+    resumeAfter(pipeline.release(), {});
+  }
+
+  /*
+   * Wait until every spawned pipeline returned and every launch is done.
+   */
+  void sync() {
+    system_.sync();
+  }
+
+  TaskSystemParallelThreadPoolSleeping& system() {
+    return system_;
+  }
+};
+
+#endif
@@ -3,6 +3,34 @@
 #include <vector>
 
 typedef int TaskID;
+typedef int GraphID;
+
+/*
+  Cumulative counters of one thread of a task system. Times are in
+  seconds.
+ */
+struct WorkerStats {
+    long tasks = 0; // Tasks executed
+    long steals = 0; // Batches of work taken from another worker's queue
+    long failed_steals = 0; // Scans of the other queues which found nothing
+    double work_time = 0; // Running tasks
+    double spin_time = 0; // Spinning while waiting for work
+    double sleep_time = 0; // Blocked while waiting for work
+};
+
+/*
+  Cumulative counters of a task system since it was created, see
+  ITaskSystem::stats().
+ */
+struct TaskSystemStats {
+    std::vector<WorkerStats> workers; // One entry per worker thread
+    WorkerStats callers; // Threads outside the pool, helping in sync() or wait()
+    long launches_submitted = 0;
+    long launches_completed = 0;
+    long max_queue_depth = 0; // The most work items ready at once
+    double dependency_time = 0; // Seconds spent releasing the successors of finished launches
+    int live_workers = -1; // Worker threads running now, -1 if the system does not say
+};
 
 class IRunnable {
     public:
@@ -61,10 +89,81 @@ class ITaskSystem {
         virtual TaskID runAsyncWithDeps(IRunnable* runnable, int num_total_tasks,
                                         const std::vector<TaskID>& deps) = 0;
 
+        /*
+          Same as above, with a scheduling priority. Among launches
+          whose dependencies are done, a task system which supports
+          priorities starts those with a larger `priority` first. The
+          default implementation ignores `priority`.
+         */
+        virtual TaskID runAsyncWithDeps(IRunnable* runnable, int num_total_tasks,
+                                        const std::vector<TaskID>& deps, int priority);
+
         /*
           Blocks until all tasks created as a result of **any prior**
           runXXX calls are done.
          */
         virtual void sync() = 0;
+
+        /*
+          Blocks until all tasks of the bulk task launch `task_id` are
+          done. Unlike sync(), launches which `task_id` does not depend
+          on may still be running when wait() returns. The waiting
+          thread may execute ready tasks of any launch while it waits.
+         */
+        virtual void wait(TaskID task_id) = 0;
+
+        /*
+          Returns whether all tasks of the bulk task launch `task_id`
+          are done, without blocking.
+         */
+        virtual bool isDone(TaskID task_id) = 0;
+
+        /*
+          Blocks until at least one of the bulk task launches in
+          `task_ids` is done and returns its identifier, or -1 if
+          `task_ids` is empty.
+         */
+        virtual TaskID waitAny(const std::vector<TaskID>& task_ids) = 0;
+
+        /*
+          Starts recording a task graph. Until endCapture(), calls to
+          runAsyncWithDeps() execute nothing: they record the launch
+          and return an identifier which is only meaningful within
+          this capture, and `deps` may only name launches recorded by
+          the same capture. Calls to run() are not recorded.
+         */
+        virtual void beginCapture() = 0;
+
+        /*
+          Stops recording and returns a handle to the recorded graph.
+         */
+        virtual GraphID endCapture() = 0;
+
+        /*
+          Executes every bulk task launch of a captured graph, in an
+          order which respects the recorded dependencies. Like
+          runAsyncWithDeps(), the caller must invoke sync() to
+          guarantee completion. A graph runs at most once at a time,
+          if it is still running launchGraph() first waits for it.
+         */
+        virtual void launchGraph(GraphID graph) = 0;
+
+        /*
+          Caps the number of worker threads the task system runs at
+          once, from 1 up to the `num_threads` it was created with. A
+          task system which can resize its pool grows back up to the
+          cap when work queues up and shrinks when workers stay idle.
+          Tasks which are already running are not interrupted. The
+          default implementation ignores the call.
+         */
+        virtual void setConcurrency(int num_threads);
+
+        /*
+          Returns the counters of the task system, which are cumulative
+          since it was created. May be called while tasks run, in which
+          case the counters are read one at a time. The default
+          implementation returns no workers and zero counters.
+         */
+        virtual TaskSystemStats stats();
 };
 #endif
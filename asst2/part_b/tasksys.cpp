@@ -1,12 +1,26 @@
 #include "tasksys.h"
 
+#include <algorithm>
+#include <chrono>
 #include <iostream>
+#include <string>
 
 IRunnable::~IRunnable() {}
 
 ITaskSystem::ITaskSystem(int num_threads) {}
 ITaskSystem::~ITaskSystem() {}
 
+TaskID ITaskSystem::runAsyncWithDeps(IRunnable* runnable, int num_total_tasks,
+                                     const std::vector<TaskID>& deps, int priority) {
+    return runAsyncWithDeps(runnable, num_total_tasks, deps);
+}
+
+void ITaskSystem::setConcurrency(int num_threads) {}
+
+TaskSystemStats ITaskSystem::stats() {
+    return TaskSystemStats();
+}
+
 /*
  * ================================================================
  * Serial task system implementation
@@ -30,17 +44,49 @@ void TaskSystemSerial::run(IRunnable* runnable, int num_total_tasks) {
 
 TaskID TaskSystemSerial::runAsyncWithDeps(IRunnable* runnable, int num_total_tasks,
                                           const std::vector<TaskID>& deps) {
+    if (recorder.active()) {
+        return recorder.record(runnable, num_total_tasks, deps);
+    }
+
     for (int i = 0; i < num_total_tasks; i++) {
         runnable->runTask(i, num_total_tasks);
     }
 
-    return 0;
+    return next_id++;
 }
 
 void TaskSystemSerial::sync() {
     return;
 }
 
+void TaskSystemSerial::wait(TaskID task_id) {
+    return;
+}
+
+bool TaskSystemSerial::isDone(TaskID task_id) {
+    return true;
+}
+
+TaskID TaskSystemSerial::waitAny(const std::vector<TaskID>& task_ids) {
+    return task_ids.empty() ? -1 : task_ids[0];
+}
+
+void TaskSystemSerial::beginCapture() {
+    recorder.begin();
+}
+
+GraphID TaskSystemSerial::endCapture() {
+    return recorder.end();
+}
+
+void TaskSystemSerial::launchGraph(GraphID graph_id) {
+    const TaskGraph* graph = recorder.graph(graph_id);
+    if (graph == nullptr) return;
+    for (const TaskGraph::Node& node : graph->nodes) {
+        run(node.runnable, node.num_total_tasks);
+    }
+}
+
 /*
  * ================================================================
  * Parallel Task System Implementation
@@ -67,11 +113,14 @@ void TaskSystemParallelSpawn::run(IRunnable* runnable, int num_total_tasks) {
 TaskID TaskSystemParallelSpawn::runAsyncWithDeps(IRunnable* runnable, int num_total_tasks,
                                                  const std::vector<TaskID>& deps) {
     // NOTE: CS149 students are not expected to implement TaskSystemParallelSpawn in Part B.
+    if (recorder.active()) {
+        return recorder.record(runnable, num_total_tasks, deps);
+    }
     for (int i = 0; i < num_total_tasks; i++) {
         runnable->runTask(i, num_total_tasks);
     }
 
-    return 0;
+    return next_id++;
 }
 
 void TaskSystemParallelSpawn::sync() {
@@ -79,6 +128,40 @@ void TaskSystemParallelSpawn::sync() {
     return;
 }
 
+void TaskSystemParallelSpawn::wait(TaskID task_id) {
+    // NOTE: CS149 students are not expected to implement TaskSystemParallelSpawn in Part B.
+    return;
+}
+
+bool TaskSystemParallelSpawn::isDone(TaskID task_id) {
+    // NOTE: CS149 students are not expected to implement TaskSystemParallelSpawn in Part B.
+    return true;
+}
+
+TaskID TaskSystemParallelSpawn::waitAny(const std::vector<TaskID>& task_ids) {
+    // NOTE: CS149 students are not expected to implement TaskSystemParallelSpawn in Part B.
+    return task_ids.empty() ? -1 : task_ids[0];
+}
+
+void TaskSystemParallelSpawn::beginCapture() {
+    // NOTE: CS149 students are not expected to implement TaskSystemParallelSpawn in Part B.
+    recorder.begin();
+}
+
+GraphID TaskSystemParallelSpawn::endCapture() {
+    // NOTE: CS149 students are not expected to implement TaskSystemParallelSpawn in Part B.
+    return recorder.end();
+}
+
+void TaskSystemParallelSpawn::launchGraph(GraphID graph_id) {
+    // NOTE: CS149 students are not expected to implement TaskSystemParallelSpawn in Part B.
+    const TaskGraph* graph = recorder.graph(graph_id);
+    if (graph == nullptr) return;
+    for (const TaskGraph::Node& node : graph->nodes) {
+        run(node.runnable, node.num_total_tasks);
+    }
+}
+
 /*
  * ================================================================
  * Parallel Thread Pool Spinning Task System Implementation
@@ -105,11 +188,14 @@ void TaskSystemParallelThreadPoolSpinning::run(IRunnable* runnable, int num_tota
 TaskID TaskSystemParallelThreadPoolSpinning::runAsyncWithDeps(IRunnable* runnable, int num_total_tasks,
                                                               const std::vector<TaskID>& deps) {
     // NOTE: CS149 students are not expected to implement TaskSystemParallelSpawn in Part B.
+    if (recorder.active()) {
+        return recorder.record(runnable, num_total_tasks, deps);
+    }
     for (int i = 0; i < num_total_tasks; i++) {
         runnable->runTask(i, num_total_tasks);
     }
 
-    return 0;
+    return next_id++;
 }
 
 void TaskSystemParallelThreadPoolSpinning::sync() {
@@ -117,6 +203,40 @@ void TaskSystemParallelThreadPoolSpinning::sync() {
     return;
 }
 
+void TaskSystemParallelThreadPoolSpinning::wait(TaskID task_id) {
+    // NOTE: CS149 students are not expected to implement TaskSystemParallelSpawn in Part B.
+    return;
+}
+
+bool TaskSystemParallelThreadPoolSpinning::isDone(TaskID task_id) {
+    // NOTE: CS149 students are not expected to implement TaskSystemParallelSpawn in Part B.
+    return true;
+}
+
+TaskID TaskSystemParallelThreadPoolSpinning::waitAny(const std::vector<TaskID>& task_ids) {
+    // NOTE: CS149 students are not expected to implement TaskSystemParallelSpawn in Part B.
+    return task_ids.empty() ? -1 : task_ids[0];
+}
+
+void TaskSystemParallelThreadPoolSpinning::beginCapture() {
+    // NOTE: CS149 students are not expected to implement TaskSystemParallelSpawn in Part B.
+    recorder.begin();
+}
+
+GraphID TaskSystemParallelThreadPoolSpinning::endCapture() {
+    // NOTE: CS149 students are not expected to implement TaskSystemParallelSpawn in Part B.
+    return recorder.end();
+}
+
+void TaskSystemParallelThreadPoolSpinning::launchGraph(GraphID graph_id) {
+    // NOTE: CS149 students are not expected to implement TaskSystemParallelSpawn in Part B.
+    const TaskGraph* graph = recorder.graph(graph_id);
+    if (graph == nullptr) return;
+    for (const TaskGraph::Node& node : graph->nodes) {
+        run(node.runnable, node.num_total_tasks);
+    }
+}
+
 /*
  * ================================================================
  * Parallel Thread Pool Sleeping Task System Implementation
@@ -127,200 +247,1049 @@ const char* TaskSystemParallelThreadPoolSleeping::name() {
   return "Parallel + Thread Pool + Sleep";
 }
 
-TaskSystemParallelThreadPoolSleeping::TaskSystemParallelThreadPoolSleeping(int num_threads)
-  : ITaskSystem(num_threads), _num_threads{num_threads} {
-  start(num_threads);
+void WorkQueue::setOrdered(bool ordered_) {
+  ordered = ordered_;
 }
 
-TaskSystemParallelThreadPoolSleeping::~TaskSystemParallelThreadPoolSleeping() {
+void WorkQueue::push(const Ticket& ticket) {
+  std::lock_guard<std::mutex> guard{mutex};
+  tickets.push_back(ticket);
+  if(ordered) std::push_heap(tickets.begin(), tickets.end());
+}
 
-  terminate = true;
+bool WorkQueue::pop(Task*& task) {
+  std::lock_guard<std::mutex> guard{mutex};
+  if(tickets.empty()) return false;
+  if(ordered) std::pop_heap(tickets.begin(), tickets.end());
+  task = tickets.back().task;
+  tickets.pop_back();
+  return true;
+}
 
-  // It may seem why here we need to use spin to test the sleepThreadNum
-  // Because of the design, there may be some threads who is not sleeping at
-  // this time, in order to make there is no dead-lock. See the `threadLoop`
-  // for more detail.
-  while(true) {
-    std::unique_lock<std::mutex> guard{queue_mutex};
-    if(sleepThreadNum == _num_threads) break;
+/**
+ * Thieves take from the front, which holds the oldest launches, so they
+ * join the launch with the most work left instead of the newest one. In
+ * an ordered queue they take the most urgent ticket, like the owner.
+ */
+bool WorkQueue::steal(Task*& task) {
+  if(ordered) return pop(task);
+  std::lock_guard<std::mutex> guard{mutex};
+  if(tickets.empty()) return false;
+  task = tickets.front().task;
+  tickets.pop_front();
+  return true;
+}
+
+void Task::reset(TaskID id_, IRunnable* runnable_, int total_tasks_) {
+  id = id_;
+  runnable = runnable_;
+  total_tasks = total_tasks_;
+  remaining = total_tasks_;
+  done = false;
+  pending = 1;
+  refs = 1;
+  successors.clear();
+  priority = 0;
+  cost = 0;
+  path = 0;
+  busy_ns = 0;
+  predecessors.clear();
+  fused.clear();
+  fused_total = 0;
+  tickets = 0;
+  sealed = false;
+}
+
+/**
+ * Whether the record holds launch `task_id` and that launch is not done.
+ * `done` is read first: reset() stores the new id before clearing
+ * `done`, so if we see the cleared flag of a recycled record we also see
+ * its new id.
+ */
+bool Task::live(TaskID task_id) const {
+  return !done.load() && id.load() == task_id;
+}
+
+/**
+ * Split `num_ids` task ids into `num_ranges_` ranges of about equal size.
+ * The ranges are allocated once per record and reused by later launches.
+ */
+void Task::partition(int num_ranges_, int num_ids) {
+  if(num_ranges_ > range_capacity) {
+    ranges.reset(new TaskRange[num_ranges_]);
+    range_capacity = num_ranges_;
   }
+  num_ranges = num_ranges_;
+  for(int r = 0; r < num_ranges; ++r) {
+    ranges[r].next.store((int)((long long)num_ids * r / num_ranges), std::memory_order_relaxed);
+    ranges[r].end = (int)((long long)num_ids * (r + 1) / num_ranges);
+  }
+}
 
-  // We should notify all the threads to return
-  producer.notify_all();
+CapturedGraph::CapturedGraph(const TaskGraph* shape_)
+  : shape(shape_), tasks(new Task[shape_->size()]) {
+  for(int i = 0; i < shape->size(); ++i) {
+    tasks[i].graph = this;
+  }
+}
 
-  for(int i = 0; i < _num_threads; i++) {
-    threads[i].join();
+Task* TaskPool::allocate(int shard) {
+  shard &= NUM_SHARDS - 1;
+  Shard& home = shards[shard];
+  std::lock_guard<std::mutex> guard{home.mutex};
+  if(home.free_list.empty()) {
+    Task* slab = new Task[SLAB_SIZE];
+    {
+      std::lock_guard<std::mutex> slab_guard{slab_mutex};
+      slabs.emplace_back(slab);
+    }
+    for(int i = SLAB_SIZE - 1; i >= 0; --i) {
+      slab[i].pool_shard = shard;
+      home.free_list.push_back(&slab[i]);
+    }
+  }
+  Task* task = home.free_list.back();
+  home.free_list.pop_back();
+  return task;
+}
+
+void TaskPool::release(Task* task) {
+  Shard& home = shards[task->pool_shard];
+  std::lock_guard<std::mutex> guard{home.mutex};
+  home.free_list.push_back(task);
+}
+
+size_t TaskPool::capacity() {
+  std::lock_guard<std::mutex> guard{slab_mutex};
+  return slabs.size() * SLAB_SIZE;
+}
+
+/*
+ * Idle workers spin this long before they park, see park.h.
+ */
+static const double SLEEPING_SPIN_US = 50;
+
+/*
+ * A worker which stays parked this long without work retires, unless
+ * the pool is down to TASKSYS_MIN_THREADS workers. TASKSYS_RETIRE_MS
+ * overrides it.
+ */
+static const double SLEEPING_RETIRE_MS = 100;
+
+/*
+ * The most launches fused into a single dispatch.
+ */
+static const int FUSE_MAX_LAUNCHES = 64;
+
+/*
+ * The number of launches we can look up by indexing `recent`, must be a
+ * power of two. Older launches which are still running move to `displaced`.
+ */
+static const int RECENT_SIZE = 4096;
+
+/*
+ * The number of SubmitShards and FuseShards, a power of two.
+ */
+static const int SUBMIT_SHARDS = 16;
+
+/*
+ * The number of runnables whose cost per task we remember, a power of two.
+ */
+static const int COST_TABLE_SIZE = 1024;
+
+/*
+ * Weight of the newest launch in the running cost estimates.
+ */
+static const double COST_SMOOTHING = 0.5;
+
+/*
+ * The tasks a thread is running, innermost first. A task which submits
+ * launches records them in its frame, so that its sync() waits for
+ * those children only: waiting for everything would include the task
+ * itself.
+ */
+struct NestedFrame {
+  TaskSystemParallelThreadPoolSleeping* system;
+  std::vector<TaskID> children;
+  NestedFrame* outer;
+};
+
+static thread_local NestedFrame* nested = nullptr;
+
+/*
+ * The pool and index of the worker running on this thread, if any.
+ */
+static thread_local TaskSystemParallelThreadPoolSleeping* worker_pool = nullptr;
+static thread_local int worker_index = -1;
+
+static SchedulePolicy schedulePolicy() {
+  const char* env = getenv("TASKSYS_SCHED");
+  if(env == nullptr) return SchedulePolicy::FIFO;
+  std::string name = env;
+  if(name == "priority") return SchedulePolicy::PRIORITY;
+  if(name == "critical_path") return SchedulePolicy::CRITICAL_PATH;
+  if(name != "fifo") {
+    fprintf(stderr, "Unknown TASKSYS_SCHED=%s, using fifo\n", env);
   }
+  return SchedulePolicy::FIFO;
+}
 
-  // We should free the memory
-  for(auto task : finished) {
-   delete task.second;
+/*
+ * A small number of the calling thread, which picks its shard of the
+ * pool and of the open dispatches.
+ */
+static int threadShard() {
+  static std::atomic<int> next_shard {0};
+  static thread_local int shard = next_shard.fetch_add(1);
+  return shard;
+}
+
+static double envNumber(const char* name, double fallback) {
+  const char* env = getenv(name);
+  return env ? atof(env) : fallback;
+}
+
+TaskSystemParallelThreadPoolSleeping::TaskSystemParallelThreadPoolSleeping(int num_threads)
+  : ITaskSystem(num_threads), _num_threads{num_threads}, limit{num_threads},
+    active(new std::atomic<bool>[num_threads]), fusers(SUBMIT_SHARDS),
+    recent(new std::atomic<Task*>[RECENT_SIZE]), shards(SUBMIT_SHARDS), policy(schedulePolicy()),
+    queues(num_threads), counters(new WorkerCounters[num_threads + 1]),
+    idle(num_threads, SLEEPING_SPIN_US) {
+  min_workers = std::max(1, std::min(num_threads, (int)envNumber("TASKSYS_MIN_THREADS", 1)));
+  retire_after = envNumber("TASKSYS_RETIRE_MS", SLEEPING_RETIRE_MS) * 1e-3;
+  locality = envNumber("TASKSYS_LOCALITY", 1) != 0;
+  fusion = policy == SchedulePolicy::FIFO && envNumber("TASKSYS_FUSE", 1) != 0;
+  if(policy == SchedulePolicy::CRITICAL_PATH) {
+    costs.resize(COST_TABLE_SIZE);
+  }
+  for(int i = 0; i < RECENT_SIZE; ++i) {
+    recent[i] = nullptr;
   }
+  for(auto& queue : queues) {
+    queue.setOrdered(policy != SchedulePolicy::FIFO);
+  }
+  start(num_threads);
+}
+
+TaskSystemParallelThreadPoolSleeping::~TaskSystemParallelThreadPoolSleeping() {
+  terminate = true;
+  idle.wakeAll();
+
+  for(int i = 0; i < _num_threads; i++) {
+    if(threads[i].joinable()) threads[i].join();
+  }
+  idle.report(name(), caller_spin.load());
 }
 
 void TaskSystemParallelThreadPoolSleeping::start(int num_threads) {
   threads.resize(num_threads);
   for(int i = 0; i < num_threads; ++i) {
-    threads[i] = std::move(std::thread(&TaskSystemParallelThreadPoolSleeping::threadLoop, this, i));
+    active[i] = false;
   }
+  grow(num_threads);
+}
+
+/**
+ * Start up to `n` more workers in the lowest free slots, without going
+ * over the limit. The thread which last ran in a slot has retired, so
+ * joining it does not block for long.
+ */
+void TaskSystemParallelThreadPoolSleeping::grow(int n) {
+  std::lock_guard<std::mutex> guard{resize_mutex};
+  for(int i = 0; i < _num_threads && n > 0 && workers.load() < limit.load(); ++i) {
+    if(active[i]) continue;
+    if(threads[i].joinable()) threads[i].join();
+    active[i] = true;
+    workers++;
+    n--;
+    threads[i] = std::thread(&TaskSystemParallelThreadPoolSleeping::threadLoop, this, i);
+  }
+}
+
+/**
+ * Let worker `index` exit if the pool has more workers than the limit,
+ * or, after an idle timeout, more than `min_workers`. The last worker
+ * never retires. A ticket may have been pushed to our deque just before
+ * we left; thieves still scan every deque, so we wake one of them.
+ */
+bool TaskSystemParallelThreadPoolSleeping::retire(int index, bool idle_timeout) {
+  std::lock_guard<std::mutex> guard{resize_mutex};
+  int floor = idle_timeout ? std::min(min_workers, limit.load()) : limit.load();
+  if(terminate || workers.load() <= std::max(floor, 1)) return false;
+  active[index] = false;
+  workers--;
+  if(queued.load() > 0) idle.wake(1);
+  return true;
+}
+
+/**
+ * Shrinking takes effect as workers finish their current ticket, idle
+ * ones are woken to retire at once. Growing starts workers only for
+ * tickets which are already queued, the rest start as work arrives.
+ */
+void TaskSystemParallelThreadPoolSleeping::setConcurrency(int num_threads) {
+  limit = std::max(1, std::min(num_threads, _num_threads));
+  int surplus = workers.load() - limit.load();
+  if(surplus > 0) {
+    idle.wake(surplus);
+  } else if(queued.load() > 0) {
+    grow(std::min(queued.load(), -surplus));
+  }
+}
+
+int TaskSystemParallelThreadPoolSleeping::numWorkers() const {
+  return workers.load();
 }
 
 /**
  * This function is the main functionality of the thread loop.
  *
+ * A worker first drains its own deque, then tries to steal from the
+ * others. When every deque is empty it spins and then parks until a
+ * ticket is queued, see park.h. The global `queue_mutex` is never taken
+ * to find work.
+ *
+ * Between tickets a worker retires if the pool is over its limit, and
+ * one which stays parked for `retire_after` retires too, so an idle
+ * pool hands its threads back.
  */
-void TaskSystemParallelThreadPoolSleeping::threadLoop(int id_) {
+void TaskSystemParallelThreadPoolSleeping::threadLoop(int index) {
+  traceThreadName("worker " + std::to_string(index));
+  pinWorker(index);
+  worker_pool = this;
+  worker_index = index;
   while(true) {
-    int index = -1;
+    if(workers.load() > limit.load() && retire(index, false)) return;
     Task* task = nullptr;
-    {
-      std::unique_lock<std::mutex> guard{queue_mutex};
-      if(ready.empty()) {
-        if(!blocked.empty()) {
-          // We should check to move the blocked to the ready.
-          moveBlockTaskToReady();
-        }
-        // If ready is still empty, we should sleep the thread.
-        if(ready.empty()) {
-            sleepThreadNum++;
-            producer.wait(guard);
-            sleepThreadNum--;
-          }
-      }
-      /*
-        * Here, we must tell whether the ready is empty,
-        * when ready.size() == 0, rand() % 0 will cause
-        * float point exception. It sucks.
-      */
-      if(!ready.empty()) {index = rand() % ready.size();
-        // Here, we use random to choose the task for each thread
-        // for simplicity.
-        task = ready[index];
-      };
+    if(queues[index].pop(task) || stealTicket(index, task)) {
+      queued.fetch_sub(1);
+      runTicket(task);
+      release(task);
+      continue;
     }
-    if(terminate) {
+    if(terminate) return;
+    if(!idle.wait(index, [this]{ return terminate || queued.load() > 0; }, retire_after) &&
+       retire(index, true)) {
       return;
     }
-    if(task == nullptr) continue;
-    int processing = -1, finished = -1;
-    {
-      std::unique_lock<std::mutex> guard{task->task_mutex};
-      processing = task->processing;
-      // There are some situations `processing` will exceed
-      // the total number, because we don't know when the
-      // `deleteFinishedTask` is finished. We may choose the
-      // task which is actually finished (or just only one)
-      if(processing >= task->total_tasks) continue;
-      task->processing++;
+  }
+}
+
+/**
+ * Scan the other workers' deques, starting from our right-hand
+ * neighbour so that thieves spread over different victims.
+ */
+bool TaskSystemParallelThreadPoolSleeping::stealTicket(int index, Task*& task) {
+  for(int i = 1; i < _num_threads; ++i) {
+    if(queues[(index + i) % _num_threads].steal(task)) {
+      counters[index].steals.fetch_add(1, std::memory_order_relaxed);
+      return true;
     }
-    if(processing < task->total_tasks) {
-      task->runnable->runTask(processing, task->total_tasks);
-      std::unique_lock<std::mutex> guard{task->task_mutex};
-      task->finished++;
-      finished = task->finished;
+  }
+  counters[index].failed_steals.fetch_add(1, std::memory_order_relaxed);
+  return false;
+}
+
+/**
+ * The counters of the calling thread: its worker's, or the shared ones
+ * of the threads outside the pool.
+ */
+WorkerCounters& TaskSystemParallelThreadPoolSleeping::countersHere() {
+  return worker_pool == this ? counters[worker_index] : counters[_num_threads];
+}
+
+/**
+ * Claim chunks of task ids from the dispatch until none is left. A worker
+ * starts on its home range, then takes from the ranges of the others,
+ * beginning with its right-hand neighbour. Every claim is a single
+ * `fetch_add` on the cursor of a range, and the grain is guided: a
+ * fraction of what is left in the range, so it starts coarse and shrinks
+ * to one task as the range nears its end, which keeps the tail balanced.
+ * A chunk of a fused dispatch may span several launches, see fuse().
+ */
+void TaskSystemParallelThreadPoolSleeping::runTicket(Task* task) {
+  if(!task->sealed.load(std::memory_order_acquire)) seal(task);
+  int num_ranges = task->num_ranges;
+  // Claimers per range: the whole pool shares a single range.
+  int sharers = num_ranges == 1 ? std::max(1, workers.load(std::memory_order_relaxed)) : 1;
+  int home = worker_pool == this && worker_index < num_ranges ? worker_index : 0;
+  // A ticket run while a task of ours waits is part of that task's time.
+  bool outermost = nested == nullptr || nested->system != this;
+  double started = outermost ? parkNow() : 0;
+  long ran = 0;
+  NestedFrame frame{this, {}, nested};
+  nested = &frame;
+  int r = 0;
+  while(r < num_ranges) {
+    TaskRange& range = task->ranges[(home + r) % num_ranges];
+    int left = range.end - range.next.load(std::memory_order_relaxed);
+    int grain = std::max(1, left / (2 * sharers));
+    int begin = left <= 0 ? range.end : range.next.fetch_add(grain, std::memory_order_relaxed);
+    if(begin >= range.end) {
+      r++;
+      continue;
     }
-    if(finished == task->total_tasks) {
-      std::unique_lock<std::mutex> guard{queue_mutex};
-      deleteFinishedTask(task);
-      // When we signalSync, there are may be some threads which
-      // are processing useless. So it may just return to the
-      // destructor. So in the destructor we must wait for all
-      // the thread going to sleep. And we call `notify_all` to
-      // make all the threads stop. The design here should be
-      // optimized. However, I don't have enough time...
-      signalSync();
+    int end = std::min(begin + grain, range.end);
+    ran += end - begin;
+    if(task->fused.empty()) {
+      runTasks(task, begin, end);
+      continue;
     }
+    const std::vector<int>& offsets = task->fused_offsets;
+    int k = (int)(std::upper_bound(offsets.begin(), offsets.end(), begin) - offsets.begin()) - 1;
+    for(; begin < end; ++k) {
+      int stop = std::min(end, offsets[k + 1]);
+      runTasks(task->fused[k], begin - offsets[k], stop - offsets[k]);
+      begin = stop;
+    }
+  }
+  nested = frame.outer;
+  WorkerCounters& mine = countersHere();
+  mine.tasks.fetch_add(ran, std::memory_order_relaxed);
+  if(outermost) addSeconds(mine.work_time, parkNow() - started);
+}
+
+/**
+ * Run the task ids [begin, end) of one launch. Completion costs one
+ * atomic decrement per chunk, whoever brings `remaining` to zero retires
+ * the launch.
+ */
+void TaskSystemParallelThreadPoolSleeping::runTasks(Task* task, int begin, int end) {
+  bool timed = policy == SchedulePolicy::CRITICAL_PATH;
+  auto start = timed ? std::chrono::steady_clock::now() : std::chrono::steady_clock::time_point();
+  double traced = traceClock();
+  for(int i = begin; i < end; ++i) {
+    nested->children.clear();
+    task->runnable->runTask(i, task->total_tasks);
+  }
+  traceComplete("tasks", traced, task->id, begin, end);
+  if(timed) {
+    auto elapsed = std::chrono::steady_clock::now() - start;
+    task->busy_ns.fetch_add(std::chrono::duration_cast<std::chrono::nanoseconds>(elapsed).count(),
+                            std::memory_order_relaxed);
+  }
+  if(task->remaining.fetch_sub(end - begin, std::memory_order_acq_rel) == end - begin) {
+    finishTask(task);
   }
 }
 
-void TaskSystemParallelThreadPoolSleeping::deleteFinishedTask(Task* task) {
-  size_t i = 0;
-  for (;i < ready.size(); ++i) {
-    if(ready[i] == task) break;
+/**
+ * Make a task runnable: give a ticket to as many workers as the launch
+ * has tasks for, see dispatch(). Every ticket holds a reference to the
+ * task, taken before any ticket becomes visible.
+ *
+ * With `locality` on, the task ids are split into one range per worker
+ * slot and worker `w` starts on range `w`. Task id `i` of a launch with
+ * `n` tasks so prefers worker `i * slots / n`, whatever the runnable, so
+ * repeated launches of the same shape over the same buffers (like the
+ * ping-pong tests) find their data in the cache that wrote it last.
+ */
+void TaskSystemParallelThreadPoolSleeping::publish(Task* task) {
+  traceInstant("ready", task->id);
+  if(task->total_tasks == 0) {
+    finishTask(task);
+    return;
   }
-  finished.insert({ready[i]->id ,ready[i]});
-  ready.erase(ready.begin() + i);
+  if(fusion) {
+    fuse(task);
+    return;
+  }
+  task->partition(rangesFor(task->total_tasks), task->total_tasks);
+  task->sealed.store(true, std::memory_order_release);
+  int tickets = std::min(task->total_tasks, std::max(1, workers.load()));
+  task->refs.fetch_add(tickets);
+  dispatch(task, tickets);
+}
 
-  if(dependency.count(task->id)) {
-    for(auto t: dependency[task->id]) {
-      t->dependencies--;
+int TaskSystemParallelThreadPoolSleeping::rangesFor(int num_ids) {
+  return locality ? std::max(1, std::min(num_ids, _num_threads)) : 1;
+}
+
+/**
+ * Make a task runnable by fusing it into the open dispatch of our
+ * FuseShard: the newest one, as long as no worker has started on it. The workers then pull
+ * through the task ids of all its launches in one pass, which saves the
+ * tickets, deque pushes and wakeups of every launch but the first. A
+ * dispatch stays open exactly as long as the workers are too busy to
+ * pick it up, so launches are only fused when they would have queued
+ * anyway, and launches released together, for example by a common
+ * dependency, always are. Each launch keeps its own id, `remaining` and
+ * successors. New tickets are handed out only as the dispatch grows past
+ * the tickets it already has.
+ *
+ * Every thread publishes through its own shard, so threads submitting at
+ * the same time do not serialize on one open dispatch; they also do not
+ * fuse with each other.
+ */
+void TaskSystemParallelThreadPoolSleeping::fuse(Task* task) {
+  int shard = threadShard() & (SUBMIT_SHARDS - 1);
+  FuseShard& fuser = fusers[shard];
+  Task* head = nullptr;
+  int tickets = 0;
+  {
+    std::lock_guard<std::mutex> guard{fuser.mutex};
+    head = fuser.open;
+    if(head == nullptr || (int)head->fused.size() >= FUSE_MAX_LAUNCHES) {
+      head = task;
+      head->fuse_shard = shard;
+      fuser.open = head;
     }
+    head->fused.push_back(task);
+    head->fused_total += task->total_tasks;
+    tickets = std::min(head->fused_total, std::max(1, workers.load())) - head->tickets;
+    if(tickets <= 0) return;
+    head->tickets += tickets;
+    head->refs.fetch_add(tickets);
+  }
+  dispatch(head, tickets);
+}
+
+/**
+ * Close a dispatch to new launches, called by the first worker to get to
+ * it. Only then are its task ids laid out and split into ranges. An open
+ * dispatch always has a queued ticket, which keeps the head alive.
+ */
+void TaskSystemParallelThreadPoolSleeping::seal(Task* head) {
+  FuseShard& fuser = fusers[head->fuse_shard];
+  std::lock_guard<std::mutex> guard{fuser.mutex};
+  if(head->sealed.load(std::memory_order_relaxed)) return;
+  if(fuser.open == head) fuser.open = nullptr;
+  head->fused_offsets.assign(1, 0);
+  for(Task* launch : head->fused) {
+    head->fused_offsets.push_back(head->fused_offsets.back() + launch->total_tasks);
   }
+  head->partition(rangesFor(head->fused_total), head->fused_total);
+  head->sealed.store(true, std::memory_order_release);
 }
 
 /**
- * Move blocked task to the ready when the task's dependency is
- * all finished.
- */
-void TaskSystemParallelThreadPoolSleeping::moveBlockTaskToReady() {
-  std::vector<Task*> moved {};
-  for(auto task : blocked) {
-    if(task->dependencies == 0) {
-      ready.push_back(task);
-      moved.push_back(task);
+ * Queue `tickets` tickets for a dispatch, whose references are already
+ * taken, then wake only as many idle workers as there are tickets. The
+ * first worker is rotated by launch id so that small launches do not all
+ * land on the same deque, except that a worker keeps the first ticket of
+ * what it publishes itself: a nested launch or a successor then starts
+ * where its input was just written.
+ *
+ * Tickets go to the deques of running workers. Those which no idle
+ * worker takes up start retired workers again, up to the limit.
+ */
+void TaskSystemParallelThreadPoolSleeping::dispatch(Task* head, int tickets) {
+  Ticket ticket{head, head->priority, head->path.load(std::memory_order_relaxed), head->id};
+  long depth = queued.fetch_add(tickets) + tickets;
+  long deepest = max_queued.load(std::memory_order_relaxed);
+  while(depth > deepest && !max_queued.compare_exchange_weak(deepest, depth, std::memory_order_relaxed)) {
+  }
+  int first = worker_pool == this ? worker_index : ticket.order;
+  int pushed = 0;
+  for(int i = 0; i < _num_threads && pushed < tickets; ++i) {
+    int slot = (first + i) % _num_threads;
+    if(!active[slot].load()) continue;
+    queues[slot].push(ticket);
+    pushed++;
+  }
+  for(; pushed < tickets; ++pushed) {
+    // Workers retired under us, the survivors steal these.
+    queues[(first + pushed) % _num_threads].push(ticket);
+  }
+  int woken = idle.wake(tickets);
+  if(woken < tickets && workers.load() < limit.load()) {
+    grow(tickets - woken);
+  }
+  if(waiters.load() > 0) {
+    // Threads blocked in wait() help with the new tickets.
+    std::unique_lock<std::mutex> guard{queue_mutex};
+    consumer.notify_all();
+  }
+}
+
+/**
+ * Called by the worker which finishes the last task of a launch. We
+ * detach the successors under the record's lock, so a concurrent
+ * submitter either sees `done` or gets its launch into the list, and then
+ * release them outside of it. The cost is proportional to the out-degree
+ * of the launch. Once done, no future launch can depend on the task, so
+ * it drops the reference it held while running.
+ *
+ * `queue_mutex` is only taken to wake sleepers: sync() once nothing is
+ * outstanding, and wait() callers, which count themselves in `waiters`
+ * before they check `done`.
+ */
+void TaskSystemParallelThreadPoolSleeping::finishTask(Task* task) {
+  std::vector<Task*> successors;
+  CapturedGraph* graph = task->graph;
+  TaskID task_id = task->id;
+  traceInstant("done", task_id);
+  {
+    std::lock_guard<std::mutex> guard{task->mutex};
+    task->done = true;
+    if(graph == nullptr) successors.swap(task->successors);
+  }
+  if(graph == nullptr) {
+    SubmitShard& shard = shards[task_id & (SUBMIT_SHARDS - 1)];
+    std::lock_guard<std::mutex> guard{shard.mutex};
+    if(!shard.displaced.empty()) shard.displaced.erase(task_id);
+  }
+  if(policy == SchedulePolicy::CRITICAL_PATH) {
+    std::lock_guard<std::mutex> guard{queue_mutex};
+    recordCost(task);
+  }
+  // Counted before sync() can see the launch finish.
+  WorkerCounters& mine = countersHere();
+  mine.completed.fetch_add(1, std::memory_order_relaxed);
+  if(outstanding.fetch_sub(1) == 1 || waiters.load() > 0) {
+    std::lock_guard<std::mutex> guard{queue_mutex};
+    consumer.notify_all();
+  }
+  double started = 0;
+  if(graph != nullptr) {
+    // The successors of a graph node were resolved by endCapture().
+    const TaskGraph* shape = graph->shape;
+    if(shape->succ_offsets[task_id] < shape->succ_offsets[task_id + 1]) started = parkNow();
+    for(int k = shape->succ_offsets[task_id]; k < shape->succ_offsets[task_id + 1]; ++k) {
+      releaseDependency(&graph->tasks[shape->successors[k]]);
     }
   }
-  for(auto task: moved) {
-    blocked.erase(task);
+  if(!successors.empty()) started = parkNow();
+  for(auto successor : successors) {
+    releaseDependency(successor);
   }
+  if(started != 0) addSeconds(mine.dependency_time, parkNow() - started);
+  release(task);
 }
 
 /**
- * When all the tasks are finished, which means `ready` and `blocked`
- * are are empty, we could signal the ONLY ONE consumer.
+ * Drop one reference to a task, the last one returns the record to the
+ * pool. The records of a graph stay with it, the last one of a replay
+ * lets launchGraph() reset them for the next.
  */
-void TaskSystemParallelThreadPoolSleeping::signalSync() {
-  if(ready.empty() && blocked.empty()) {
-    consumer.notify_one();
+void TaskSystemParallelThreadPoolSleeping::release(Task* task) {
+  if(task->refs.fetch_sub(1, std::memory_order_acq_rel) != 1) return;
+  if(task->graph == nullptr) {
+    pool.release(task);
+  } else if(task->graph->running.fetch_sub(1) == 1) {
+    std::unique_lock<std::mutex> guard{queue_mutex};
+    consumer.notify_all();
+  }
+}
+
+/**
+ * Drop one pending dependency of a task, the last one to go publishes it.
+ */
+void TaskSystemParallelThreadPoolSleeping::releaseDependency(Task* task) {
+  if(task->pending.fetch_sub(1) == 1) {
+    publish(task);
   }
 }
 
 /**
  * It is easy for us to simulate the `run`. Just call the `runAsyncWithDeps` and
  * use `sync` for synchronization. This is the most easy part in part B.
+ * Inside a task we only wait for the new launch, running other tickets
+ * meanwhile, since the task calling us is itself still outstanding.
  * @param runnable
  * @param num_total_tasks
  */
 void TaskSystemParallelThreadPoolSleeping::run(IRunnable* runnable, int num_total_tasks) {
-  runAsyncWithDeps(runnable, num_total_tasks, {});
+  TaskID task_id = submit(runnable, num_total_tasks, {}, 0);
+  if(nested != nullptr && nested->system == this) {
+    nested->children.pop_back();
+    wait(task_id);
+    return;
+  }
   sync();
 }
 
-/**
- * For simplicity and easy-handling, we just make the new task to the `blocked`, and record
- * the dependency information and notify all the producers, and immediately return to the
- * user for async operation. And also we make the implementation more easily.
- */
 TaskID TaskSystemParallelThreadPoolSleeping::runAsyncWithDeps(IRunnable* runnable, int num_total_tasks,
                                                     const std::vector<TaskID>& deps) {
-  Task* task = new Task(id, runnable, num_total_tasks, deps.size());
+  return runAsyncWithDeps(runnable, num_total_tasks, deps, 0);
+}
+
+TaskID TaskSystemParallelThreadPoolSleeping::runAsyncWithDeps(IRunnable* runnable, int num_total_tasks,
+                                                    const std::vector<TaskID>& deps, int priority) {
+  if(recorder.active()) {
+    return recorder.record(runnable, num_total_tasks, deps, priority);
+  }
+  return submit(runnable, num_total_tasks, deps, priority);
+}
+
+/**
+ * Register the new launch as a successor of every dependency which is not
+ * done yet. `pending` starts at one so that no dependency can publish the
+ * launch while we are still registering it; dropping that extra count at
+ * the end publishes it directly if every dependency was already done.
+ *
+ * Any number of threads may submit at once. The id comes from an atomic
+ * counter and the record from our shard of the pool; the record is
+ * indexed by the low bits of its id in `recent`, under the lock of the
+ * SubmitShard of those bits. If the slot still holds a launch which is
+ * not done, that launch moves to the shard's `displaced` until it
+ * finishes. A dependency is only locked to append to its successors.
+ *
+ * Under CRITICAL_PATH the new launch also lengthens the estimated path
+ * of every launch it depends on, see propagatePath(), so those
+ * submissions still go one at a time under `queue_mutex`.
+ */
+TaskID TaskSystemParallelThreadPoolSleeping::submit(IRunnable* runnable, int num_total_tasks,
+                                                  const std::vector<TaskID>& deps, int priority) {
+  TaskID task_id = id.fetch_add(1);
+  outstanding.fetch_add(1);
+  Task* task = pool.allocate(threadShard());
   {
-    std::unique_lock<std::mutex> guard{queue_mutex};
-    // We just simply add the task to the blocked.
-    blocked.insert(task);
-
-    // Record dependency information for later processing
-    for (TaskID dep : deps) {
-      if (dependency.count(dep)) {
-        dependency[dep].insert(task);
-      } else {
-        dependency[dep] = std::unordered_set<Task*>{task};
+    // The record is reset under the shard lock, so a slot check never
+    // sees the record of another launch of the same slot half reset.
+    // The slot may point to a record already recycled for a launch
+    // which lives in another slot, that one is not ours to move.
+    SubmitShard& shard = shards[task_id & (SUBMIT_SHARDS - 1)];
+    std::lock_guard<std::mutex> guard{shard.mutex};
+    task->reset(task_id, runnable, num_total_tasks);
+    task->priority = priority;
+    std::atomic<Task*>& slot = recent[task_id & (RECENT_SIZE - 1)];
+    Task* old = slot.load();
+    if(old != nullptr) {
+      TaskID old_id = old->id;
+      if((old_id & (RECENT_SIZE - 1)) == (task_id & (RECENT_SIZE - 1)) && old->live(old_id)) {
+        shard.displaced.insert({old_id, old});
       }
     }
-    // We should notify the producer to continue processing
-    producer.notify_all();
+    slot.store(task);
+  }
+
+  countersHere().submitted.fetch_add(1, std::memory_order_relaxed);
+  bool critical_path = policy == SchedulePolicy::CRITICAL_PATH;
+  std::unique_lock<std::mutex> path_guard{queue_mutex, std::defer_lock};
+  if(critical_path) path_guard.lock();
+  for (TaskID dep : deps) {
+    Task* parent = find(dep);
+    if (parent == nullptr) continue;
+    std::lock_guard<std::mutex> guard{parent->mutex};
+    if (!parent->live(dep)) continue;
+    parent->successors.push_back(task);
+    task->pending++;
+    if (critical_path) task->predecessors.push_back({parent, dep});
+  }
+  if (critical_path) {
+    task->cost = launchCost(runnable, num_total_tasks);
+    task->path = task->cost;
+    propagatePath(task);
+    path_guard.unlock();
+  }
+  traceInstant("submit", task_id);
+  if(nested != nullptr && nested->system == this) {
+    nested->children.push_back(task_id);
   }
-  return id++;
+  releaseDependency(task);
+  return task_id;
 }
 
 /**
  * This function is provided to the user for waiting for
- * all tasks finished. We can just use a single condition
- * variable to achieve the functionality
+ * all tasks finished. We spin for a while like the workers,
+ * then fall back to a single condition variable.
+ *
+ * Called from inside a task, it waits for the launches which that task
+ * submitted instead, and runs queued tickets while it waits.
  */
 void TaskSystemParallelThreadPoolSleeping::sync() {
+  if(nested != nullptr && nested->system == this) {
+    std::vector<TaskID> children;
+    children.swap(nested->children);
+    for(TaskID child : children) {
+      wait(child);
+    }
+    return;
+  }
+  double traced = traceClock();
+  double spun = 0;
+  bool spun_done = spinUntil([this]{ return outstanding.load() == 0; }, idle.budgetSeconds(), spun);
+  if(spun > 0) addSeconds(caller_spin, spun);
+  if(spun_done) {
+    traceComplete("sync", traced);
+    return;
+  }
   std::unique_lock<std::mutex> lock{queue_mutex};
-  if(!ready.empty() || !blocked.empty()) {
-    consumer.wait(lock);
+  consumer.wait(lock, [this]{ return outstanding.load() == 0; });
+  traceComplete("sync", traced);
+}
+
+/**
+ * The estimated time to run a launch, must hold `queue_mutex`. Its tasks
+ * run in about ceil(n / threads) waves of the runnable's observed cost
+ * per task; a runnable we have not seen yet is assumed to cost as much
+ * as the average one.
+ */
+double TaskSystemParallelThreadPoolSleeping::launchCost(IRunnable* runnable, int num_total_tasks) {
+  const CostEstimate& estimate = costs[(reinterpret_cast<uintptr_t>(runnable) >> 4) & (COST_TABLE_SIZE - 1)];
+  double per_task = estimate.runnable == runnable ? estimate.per_task : mean_task_cost;
+  if(per_task == 0) per_task = 1e-6;
+  int waves = (num_total_tasks + _num_threads - 1) / _num_threads;
+  return per_task * waves;
+}
+
+/**
+ * Fold the measured cost of a finished launch into the estimates, must
+ * hold `queue_mutex`.
+ */
+void TaskSystemParallelThreadPoolSleeping::recordCost(Task* task) {
+  task->predecessors.clear();
+  if(task->total_tasks == 0) return;
+  double per_task = task->busy_ns.load() * 1e-9 / task->total_tasks;
+  CostEstimate& estimate = costs[(reinterpret_cast<uintptr_t>(task->runnable) >> 4) & (COST_TABLE_SIZE - 1)];
+  if(estimate.runnable == task->runnable) {
+    estimate.per_task += COST_SMOOTHING * (per_task - estimate.per_task);
+  } else {
+    estimate.runnable = task->runnable;
+    estimate.per_task = per_task;
+  }
+  if(mean_task_cost == 0) {
+    mean_task_cost = per_task;
+  } else {
+    mean_task_cost += COST_SMOOTHING * (per_task - mean_task_cost);
+  }
+}
+
+/**
+ * A launch's path is its own cost plus the longest path among its
+ * successors. A new successor can only lengthen the paths above it, so
+ * we walk up the unfinished predecessors for as long as a path grows;
+ * must hold `queue_mutex`. A predecessor whose record was recycled has
+ * another id by now and is skipped, like a finished one.
+ */
+void TaskSystemParallelThreadPoolSleeping::propagatePath(Task* task) {
+  std::vector<Task*> stack{task};
+  while(!stack.empty()) {
+    Task* current = stack.back();
+    stack.pop_back();
+    double through = current->path.load(std::memory_order_relaxed);
+    for(auto& predecessor : current->predecessors) {
+      Task* parent = predecessor.first;
+      if(!parent->live(predecessor.second)) continue;
+      double path = parent->cost + through;
+      if(path > parent->path.load(std::memory_order_relaxed)) {
+        parent->path.store(path, std::memory_order_relaxed);
+        stack.push_back(parent);
+      }
+    }
+  }
+}
+
+/**
+ * Sum up the counters. Parked time counts as sleeping, and a ticket
+ * counts as a steal when it came from another worker's deque.
+ */
+TaskSystemStats TaskSystemParallelThreadPoolSleeping::stats() {
+  TaskSystemStats result;
+  auto collect = [&](const WorkerCounters& from, WorkerStats& to) {
+    to.tasks = from.tasks.load(std::memory_order_relaxed);
+    to.steals = from.steals.load(std::memory_order_relaxed);
+    to.failed_steals = from.failed_steals.load(std::memory_order_relaxed);
+    to.work_time = from.work_time.load(std::memory_order_relaxed);
+    result.launches_submitted += from.submitted.load(std::memory_order_relaxed);
+    result.launches_completed += from.completed.load(std::memory_order_relaxed);
+    result.dependency_time += from.dependency_time.load(std::memory_order_relaxed);
+  };
+  result.workers.resize(_num_threads);
+  for(int i = 0; i < _num_threads; ++i) {
+    collect(counters[i], result.workers[i]);
+    result.workers[i].spin_time = idle.spinSeconds(i);
+    result.workers[i].sleep_time = idle.parkSeconds(i);
+  }
+  collect(counters[_num_threads], result.callers);
+  result.callers.spin_time = caller_spin.load();
+  result.max_queue_depth = max_queued.load(std::memory_order_relaxed);
+  result.live_workers = workers.load();
+  return result;
+}
+
+size_t TaskSystemParallelThreadPoolSleeping::numSteals() const {
+  size_t total = 0;
+  for(int i = 0; i <= _num_threads; ++i) {
+    total += counters[i].steals.load(std::memory_order_relaxed);
+  }
+  return total;
+}
+
+size_t TaskSystemParallelThreadPoolSleeping::numTaskRecords() {
+  return pool.capacity();
+}
+
+/**
+ * Find the record of a launch. A record may have been recycled for a
+ * later launch, which its `id` tells us. We return nullptr for a launch
+ * whose record is gone, which is always done, and for an id we never
+ * returned. Nothing stops the record from being recycled right after,
+ * so callers check Task::live() under the record's lock.
+ */
+Task* TaskSystemParallelThreadPoolSleeping::find(TaskID task_id) {
+  if(task_id < 0 || task_id >= id.load()) return nullptr;
+  Task* task = recent[task_id & (RECENT_SIZE - 1)].load();
+  if(task != nullptr && task->id.load() == task_id) return task;
+  SubmitShard& shard = shards[task_id & (SUBMIT_SHARDS - 1)];
+  std::lock_guard<std::mutex> guard{shard.mutex};
+  if(shard.displaced.empty()) return nullptr;
+  auto it = shard.displaced.find(task_id);
+  return it == shard.displaced.end() ? nullptr : it->second;
+}
+
+/**
+ * Find a launch which is not done and take a reference to it, so that
+ * the record is not recycled while we wait. nullptr means it is done.
+ * While the launch is not done it holds a reference of its own, which
+ * it drops only after setting `done` under the record's lock.
+ */
+Task* TaskSystemParallelThreadPoolSleeping::lookup(TaskID task_id) {
+  Task* task = find(task_id);
+  if(task == nullptr) return nullptr;
+  std::lock_guard<std::mutex> guard{task->mutex};
+  if(!task->live(task_id)) return nullptr;
+  task->refs++;
+  return task;
+}
+
+/**
+ * Run one queued ticket on the calling thread. A worker waiting inside a
+ * task takes from its own deque first, which holds the launches it just
+ * submitted, so nested launches run depth first. Any other thread has no
+ * deque and steals. Returns false if there was nothing to run.
+ */
+bool TaskSystemParallelThreadPoolSleeping::helpOnce() {
+  Task* task = nullptr;
+  if(worker_pool == this) {
+    if(queues[worker_index].pop(task) || stealTicket(worker_index, task)) {
+      queued.fetch_sub(1);
+      runTicket(task);
+      release(task);
+      return true;
+    }
+    return false;
+  }
+  WorkerCounters& callers = counters[_num_threads];
+  for(int i = 0; i < _num_threads; ++i) {
+    if(queues[i].steal(task)) {
+      callers.steals.fetch_add(1, std::memory_order_relaxed);
+      queued.fetch_sub(1);
+      runTicket(task);
+      release(task);
+      return true;
+    }
+  }
+  callers.failed_steals.fetch_add(1, std::memory_order_relaxed);
+  return false;
+}
+
+/**
+ * Block the calling thread until `done()` holds. While there are queued
+ * tickets it runs them instead of sleeping, so a waiting thread adds to
+ * the pool rather than idling next to it.
+ */
+template <typename Done>
+void TaskSystemParallelThreadPoolSleeping::waitUntil(Done done) {
+  while(!done()) {
+    if(helpOnce()) continue;
+    std::unique_lock<std::mutex> guard{queue_mutex};
+    waiters++;
+    consumer.wait(guard, [&]{ return done() || queued.load() > 0; });
+    waiters--;
+  }
+}
+
+void TaskSystemParallelThreadPoolSleeping::wait(TaskID task_id) {
+  Task* task = lookup(task_id);
+  if(task == nullptr) return;
+  waitUntil([task]{ return task->done.load(); });
+  release(task);
+}
+
+bool TaskSystemParallelThreadPoolSleeping::isDone(TaskID task_id) {
+  Task* task = lookup(task_id);
+  if(task == nullptr) return true;
+  bool done = task->done;
+  release(task);
+  return done;
+}
+
+TaskID TaskSystemParallelThreadPoolSleeping::waitAny(const std::vector<TaskID>& task_ids) {
+  if(task_ids.empty()) return -1;
+  std::vector<Task*> candidates;
+  TaskID first = -1;
+  for(TaskID task_id : task_ids) {
+    Task* task = lookup(task_id);
+    if(task == nullptr) {
+      first = task_id;
+      break;
+    }
+    candidates.push_back(task);
+  }
+  if(first == -1) {
+    waitUntil([&]{
+      for(Task* task : candidates) {
+        if(task->done) {
+          first = task->id;
+          return true;
+        }
+      }
+      return false;
+    });
+  }
+  for(Task* task : candidates) {
+    release(task);
+  }
+  return first;
+}
+
+void TaskSystemParallelThreadPoolSleeping::beginCapture() {
+  recorder.begin();
+}
+
+GraphID TaskSystemParallelThreadPoolSleeping::endCapture() {
+  GraphID graph_id = recorder.end();
+  graphs.emplace_back(new CapturedGraph(recorder.graph(graph_id)));
+  return graph_id;
+}
+
+/**
+ * Replay a captured graph without touching the pool, `recent` or any
+ * successor list. Every record of the graph is reset with its pending
+ * count set to the number of its dependencies, and only then are the
+ * roots published, so a finishing node always finds its successors
+ * ready to be released. The previous replay must have let go of every
+ * record first, tickets included, which is what `running` counts.
+ *
+ * The nodes take a block of ids from the same counter as launches, so
+ * that they order, trace and look up like launches submitted now. No
+ * launch ever gets one of those ids, and find() never finds one, since
+ * the records of a graph are never in `recent`.
+ */
+void TaskSystemParallelThreadPoolSleeping::launchGraph(GraphID graph_id) {
+  if(graph_id < 0 || graph_id >= (GraphID)graphs.size()) return;
+  CapturedGraph* graph = graphs[graph_id].get();
+  const TaskGraph* shape = graph->shape;
+  if(shape->size() == 0) return;
+  waitUntil([graph]{ return graph->running.load() == 0; });
+
+  TaskID first_id = id.fetch_add(shape->size());
+  for(int i = 0; i < shape->size(); ++i) {
+    Task& task = graph->tasks[i];
+    task.reset(first_id + i, shape->nodes[i].runnable, shape->nodes[i].num_total_tasks);
+    task.priority = shape->nodes[i].priority;
+    task.pending = shape->numDeps(i);
+  }
+  if(policy == SchedulePolicy::CRITICAL_PATH) {
+    // Walking the nodes backwards visits successors first.
+    std::unique_lock<std::mutex> guard{queue_mutex};
+    for(int i = shape->size() - 1; i >= 0; --i) {
+      Task& task = graph->tasks[i];
+      double longest = 0;
+      for(int k = shape->succ_offsets[i]; k < shape->succ_offsets[i + 1]; ++k) {
+        longest = std::max(longest, graph->tasks[shape->successors[k]].path.load(std::memory_order_relaxed));
+      }
+      task.cost = launchCost(task.runnable, task.total_tasks);
+      task.path = task.cost + longest;
+    }
+  }
+  graph->running = shape->size();
+  outstanding.fetch_add(shape->size());
+  countersHere().submitted.fetch_add(shape->size(), std::memory_order_relaxed);
+  for(int root : shape->roots) {
+    publish(&graph->tasks[root]);
   }
 }
@@ -2,6 +2,9 @@
 #define _TASKSYS_H
 
 #include <vector>
+#include <deque>
+#include <memory>
+#include <atomic>
 #include <thread>
 #include <mutex>
 #include <random>
@@ -10,6 +13,10 @@
 #include <unordered_map>
 #include <condition_variable>
 #include "itasksys.h"
+#include "affinity.h"
+#include "park.h"
+#include "trace.h"
+#include "graph.h"
 
 /*
  * TaskSystemSerial: This class is the student's implementation of a
@@ -17,6 +24,9 @@
  * itasksys.h for documentation of the ITaskSystem interface.
  */
 class TaskSystemSerial: public ITaskSystem {
+    private:
+        GraphRecorder recorder;
+        std::atomic<TaskID> next_id {0};
     public:
         TaskSystemSerial(int num_threads);
         ~TaskSystemSerial();
@@ -25,6 +35,12 @@ class TaskSystemSerial: public ITaskSystem {
         TaskID runAsyncWithDeps(IRunnable* runnable, int num_total_tasks,
                                 const std::vector<TaskID>& deps);
         void sync();
+        void wait(TaskID task_id);
+        bool isDone(TaskID task_id);
+        TaskID waitAny(const std::vector<TaskID>& task_ids);
+        void beginCapture();
+        GraphID endCapture();
+        void launchGraph(GraphID graph);
 };
 
 /*
@@ -34,6 +50,9 @@ class TaskSystemSerial: public ITaskSystem {
  * of the ITaskSystem interface.
  */
 class TaskSystemParallelSpawn: public ITaskSystem {
+    private:
+        GraphRecorder recorder;
+        std::atomic<TaskID> next_id {0};
     public:
         TaskSystemParallelSpawn(int num_threads);
         ~TaskSystemParallelSpawn();
@@ -42,6 +61,12 @@ class TaskSystemParallelSpawn: public ITaskSystem {
         TaskID runAsyncWithDeps(IRunnable* runnable, int num_total_tasks,
                                 const std::vector<TaskID>& deps);
         void sync();
+        void wait(TaskID task_id);
+        bool isDone(TaskID task_id);
+        TaskID waitAny(const std::vector<TaskID>& task_ids);
+        void beginCapture();
+        GraphID endCapture();
+        void launchGraph(GraphID graph);
 };
 
 /*
@@ -51,6 +76,9 @@ class TaskSystemParallelSpawn: public ITaskSystem {
  * documentation of the ITaskSystem interface.
  */
 class TaskSystemParallelThreadPoolSpinning: public ITaskSystem {
+    private:
+        GraphRecorder recorder;
+        std::atomic<TaskID> next_id {0};
     public:
         TaskSystemParallelThreadPoolSpinning(int num_threads);
         ~TaskSystemParallelThreadPoolSpinning();
@@ -59,6 +87,12 @@ class TaskSystemParallelThreadPoolSpinning: public ITaskSystem {
         TaskID runAsyncWithDeps(IRunnable* runnable, int num_total_tasks,
                                 const std::vector<TaskID>& deps);
         void sync();
+        void wait(TaskID task_id);
+        bool isDone(TaskID task_id);
+        TaskID waitAny(const std::vector<TaskID>& task_ids);
+        void beginCapture();
+        GraphID endCapture();
+        void launchGraph(GraphID graph);
 };
 
 /*
@@ -68,38 +102,248 @@ class TaskSystemParallelThreadPoolSpinning: public ITaskSystem {
  * itasksys.h for documentation of the ITaskSystem interface.
  */
 
+class CapturedGraph;
+
+/*
+ * How workers choose among queued tickets, set with TASKSYS_SCHED:
+ *  - fifo (default): a worker runs its newest ticket, thieves take the
+ *    oldest, priorities are ignored.
+ *  - priority: the ticket with the largest priority runs first.
+ *  - critical_path: by priority, then by the estimated length of the
+ *    longest path from the launch to the end of the DAG. Opt-in: it has
+ *    not been shown to beat fifo on strict_graph_deps_*, and it adds
+ *    timing and a lock on every launch.
+ */
+enum class SchedulePolicy { FIFO, PRIORITY, CRITICAL_PATH };
+
+/*
+ * TaskRange: a contiguous range of the task ids of a launch, claimed
+ * through its own cursor. Padded so that workers claiming from
+ * different ranges never share a cache line.
+ */
+struct TaskRange {
+  std::atomic<int> next {0}; // The first task id which is not claimed yet
+  int end = 0;
+  char padding[56];
+};
+
 class Task {
 public:
-  TaskID id;
-  IRunnable* runnable;
-  int processing = 0;
-  int finished = 0;
-  int total_tasks;
-  size_t dependencies;
-  std::mutex task_mutex;
-  Task(TaskID id_, IRunnable* runnable_, int total_tasks_, size_t deps)
-    :id(id_), runnable(runnable_), total_tasks(total_tasks_), dependencies(deps) {}
+  std::atomic<TaskID> id {-1}; // Changes when the record is recycled
+  std::mutex mutex; // guards `successors` and the setting of `done`
+  IRunnable* runnable = nullptr;
+  int total_tasks = 0;
+  std::unique_ptr<TaskRange[]> ranges; // The task ids which are not claimed yet
+  int num_ranges = 0;
+  int range_capacity = 0;
+  std::vector<Task*> fused; // The launches of the dispatch this one heads, itself first
+  std::vector<int> fused_offsets; // Where each of `fused` starts in the dispatch's task ids
+  int fused_total = 0; // Task ids of the dispatch, guarded by its FuseShard
+  int tickets = 0; // Tickets handed out for the dispatch, guarded by its FuseShard
+  int fuse_shard = 0; // The FuseShard of the dispatch
+  std::atomic<bool> sealed {false}; // Set once no launch may join the dispatch
+  std::atomic<int> remaining {0}; // Task ids which are not finished yet
+  std::atomic<bool> done {false}; // Set under `mutex`
+  std::atomic<int> pending {0}; // Unfinished dependencies, plus one while submitting
+  std::atomic<int> refs {0}; // One while not done, one per ticket and per waiter
+  std::vector<Task*> successors; // Launches waiting for this one, guarded by `mutex`
+  CapturedGraph* graph = nullptr; // The graph owning this record, if any
+  int pool_shard = 0; // The TaskPool shard the record returns to
+  int priority = 0;
+  double cost = 0; // Estimated seconds to run the launch, for CRITICAL_PATH
+  std::atomic<double> path {0}; // Estimated seconds from its start to the end of the DAG, written under `queue_mutex`
+  std::atomic<long> busy_ns {0}; // Time spent running its tasks, for CRITICAL_PATH
+  std::vector<std::pair<Task*, TaskID>> predecessors; // Its dependencies which were not done, for CRITICAL_PATH
+  void reset(TaskID id_, IRunnable* runnable_, int total_tasks_);
+  bool live(TaskID task_id) const;
+  void partition(int num_ranges_, int num_ids);
+};
+
+/*
+ * CapturedGraph: a captured TaskGraph with one Task record per node,
+ * allocated once by endCapture() and reset by every replay.
+ */
+class CapturedGraph {
+public:
+  const TaskGraph* shape;
+  std::unique_ptr<Task[]> tasks;
+  std::atomic<int> running {0}; // Nodes of the current replay which still hold references
+  CapturedGraph(const TaskGraph* shape_);
+};
+
+/*
+ * TaskPool: recycles Task records, so that a long running task system
+ * does not allocate per launch. Records live in slabs which are neither
+ * moved nor freed before the pool is destroyed, so an old Task* can
+ * always be read, and its `id` tells whether it still holds the launch
+ * we are looking for.
+ *
+ * The free records are split into shards, each submitting thread
+ * allocates from its own. A record goes back to the shard whose slab it
+ * came from, so records cycle between a submitter and the workers
+ * without the submitters contending for one lock.
+ */
+class TaskPool {
+public:
+  static const int NUM_SHARDS = 16;
+private:
+  static const int SLAB_SIZE = 256;
+  struct Shard {
+    std::mutex mutex;
+    std::vector<Task*> free_list;
+    char padding[64];
+  };
+  Shard shards[NUM_SHARDS];
+  std::mutex slab_mutex; // guards `slabs`
+  std::vector<std::unique_ptr<Task[]>> slabs;
+public:
+  Task* allocate(int shard);
+  void release(Task* task);
+  size_t capacity();
+};
+
+/*
+ * SubmitShard: the `recent` slots of the launch ids whose low bits
+ * select this shard, and the live launches pushed out of them. Lookups
+ * of different launches rarely take the same lock.
+ */
+struct SubmitShard {
+  std::mutex mutex; // guards `displaced` and the writes to its slots of `recent`
+  std::unordered_map<TaskID, Task*> displaced;
+  char padding[64];
+};
+
+/*
+ * FuseShard: the open dispatch of the threads which publish through this
+ * shard, see fuse().
+ */
+struct FuseShard {
+  std::mutex mutex; // guards `open` and the fused lists of its dispatches
+  Task* open = nullptr; // The newest dispatch no worker has started on
+  char padding[64];
+};
+
+/*
+ * WorkerCounters: the statistics of one worker, or of all the threads
+ * outside the pool, see stats(). Each set has its own cache line, and
+ * a worker only adds to its own, so counting costs a relaxed add to a
+ * line no other thread writes.
+ */
+struct WorkerCounters {
+  std::atomic<long> tasks {0};
+  std::atomic<long> steals {0};
+  std::atomic<long> failed_steals {0};
+  std::atomic<long> submitted {0}; // Launches submitted from this thread
+  std::atomic<long> completed {0}; // Launches this thread finished
+  std::atomic<double> work_time {0};
+  std::atomic<double> dependency_time {0};
+  char padding[64];
+};
+
+/*
+ * Ticket: lets its holder claim ranges of task ids from one launch. The
+ * scheduling key is copied when the ticket is queued, so that a later
+ * change to the launch's estimate cannot break the order of a queue.
+ */
+struct Ticket {
+  Task* task;
+  int priority;
+  double path;
+  TaskID order;
+  bool operator<(const Ticket& other) const {
+    if(priority != other.priority) return priority < other.priority;
+    if(path != other.path) return path < other.path;
+    return order > other.order;
+  }
+};
+
+/*
+ * WorkQueue: the deque owned by a single worker. The owner pushes and
+ * pops at the back, idle workers steal from the front. An ordered queue
+ * is a max-heap of tickets instead, where both take the top. Each deque
+ * has its own lock, so workers never contend on the global `queue_mutex`
+ * to find work.
+ */
+class WorkQueue {
+private:
+  std::mutex mutex;
+  std::deque<Ticket> tickets;
+  bool ordered = false;
+public:
+  void setOrdered(bool ordered_);
+  void push(const Ticket& ticket);
+  bool pop(Task*& task);
+  bool steal(Task*& task);
+};
+
+/*
+ * CostEstimate: the observed cost per task of a runnable, averaged over
+ * its launches. The estimates live in a small direct-mapped table, so a
+ * stream of distinct runnables does not grow it.
+ */
+struct CostEstimate {
+  IRunnable* runnable = nullptr;
+  double per_task = 0;
 };
 
 class TaskSystemParallelThreadPoolSleeping: public ITaskSystem {
 private:
-  bool terminate = false; // To indicate whether to stop the thread pool
-  int _num_threads = 0; // To indicate how many threads
-  int sleepThreadNum = 0; // The number of thread which is sleeping
-  std::unordered_map<TaskID, Task*> finished {}; // To record the finished task
-  std::vector<Task*> ready {}; // The task is ready to be processed
-  std::unordered_set<Task*> blocked {}; // The task is blocked
+  std::atomic<bool> terminate {false}; // To indicate whether to stop the thread pool
+  int _num_threads = 0; // The most workers we may run, each has a fixed slot
+  std::atomic<int> workers {0}; // Running workers, changed under `resize_mutex`
+  std::atomic<int> limit {0}; // Set by setConcurrency()
+  int min_workers = 1; // Idle workers retire down to this many
+  bool locality = true; // Whether task ids have a home worker, see publish()
+  bool fusion = true; // Whether ready launches join open dispatches, see fuse()
+  double retire_after = 0; // Seconds a parked worker waits for work before it retires
+  std::unique_ptr<std::atomic<bool>[]> active; // Which slots run a worker, changed under `resize_mutex`
+  std::mutex resize_mutex; // guards `threads`
+  std::vector<FuseShard> fusers; // Indexed by the shard of the publishing thread
+  std::atomic<int> outstanding {0}; // Launches which are not finished
+  std::atomic<int> queued {0}; // Tickets sitting in the deques
+  TaskPool pool;
+  std::unique_ptr<std::atomic<Task*>[]> recent; // Launch records indexed by the low bits of their id
+  std::vector<SubmitShard> shards; // Indexed by the low bits of a launch id
+  GraphRecorder recorder;
+  std::vector<std::unique_ptr<CapturedGraph>> graphs; // Indexed by GraphID
+  SchedulePolicy policy;
+  std::vector<CostEstimate> costs; // Guarded by `queue_mutex`
+  double mean_task_cost = 0; // Over all runnables, for those we have not seen yet
   std::vector<std::thread> threads;
-  std::unordered_map<TaskID, std::unordered_set<Task*>> dependency {}; // The dependency information
-  TaskID id = 0;
-  std::mutex queue_mutex;
+  std::vector<WorkQueue> queues; // One deque per worker
+  std::unique_ptr<WorkerCounters[]> counters; // One per worker slot, then one for other threads
+  std::atomic<long> max_queued {0}; // The most tickets queued at once
+  std::atomic<TaskID> id {0}; // The next launch id
+  std::mutex queue_mutex; // For sleeping in sync() and wait(), and for CRITICAL_PATH
   std::condition_variable consumer;
-  std::condition_variable producer;
+  std::atomic<int> waiters {0}; // Threads blocked in wait() or waitAny()
+  IdleWorkers idle; // Spin-then-park waiting of the workers
+  std::atomic<double> caller_spin {0}; // Seconds spun in sync()
+  WorkerCounters& countersHere();
   void start(int num_threads);
+  void grow(int n);
+  bool retire(int index, bool idle_timeout);
   void threadLoop(int index);
-  void deleteFinishedTask(Task* task);
-  void moveBlockTaskToReady();
-  void signalSync();
+  bool stealTicket(int index, Task*& task);
+  void runTicket(Task* task);
+  void runTasks(Task* task, int begin, int end);
+  int rangesFor(int num_ids);
+  TaskID submit(IRunnable* runnable, int num_total_tasks, const std::vector<TaskID>& deps,
+               int priority);
+  double launchCost(IRunnable* runnable, int num_total_tasks);
+  void recordCost(Task* task);
+  void propagatePath(Task* task);
+  void publish(Task* task);
+  void fuse(Task* task);
+  void seal(Task* head);
+  void dispatch(Task* head, int tickets);
+  void finishTask(Task* task);
+  void releaseDependency(Task* task);
+  Task* find(TaskID task_id);
+  Task* lookup(TaskID task_id);
+  void release(Task* task);
+  bool helpOnce();
+  template <typename Done> void waitUntil(Done done);
 public:
   TaskSystemParallelThreadPoolSleeping(int num_threads);
   ~TaskSystemParallelThreadPoolSleeping();
@@ -107,7 +351,20 @@ public:
   void run(IRunnable* runnable, int num_total_tasks);
   TaskID runAsyncWithDeps(IRunnable* runnable, int num_total_tasks,
                           const std::vector<TaskID>& deps);
+  TaskID runAsyncWithDeps(IRunnable* runnable, int num_total_tasks,
+                          const std::vector<TaskID>& deps, int priority);
   void sync();
+  void wait(TaskID task_id);
+  bool isDone(TaskID task_id);
+  TaskID waitAny(const std::vector<TaskID>& task_ids);
+  void beginCapture();
+  GraphID endCapture();
+  void launchGraph(GraphID graph);
+  void setConcurrency(int num_threads);
+  int numWorkers() const; // Workers running right now
+  TaskSystemStats stats();
+  size_t numSteals() const; // For checking how well the deques balance
+  size_t numTaskRecords(); // Task records allocated so far
 };
 
 #endif
@@ -0,0 +1,416 @@
+#ifndef _BACKENDS_H
+#define _BACKENDS_H
+
+/*
+ * Reference task systems for runtasks, built on stock runtimes, so that
+ * every test shows how the student task systems compare with what the
+ * standard tools give for free.
+ *
+ *  - TaskSystemOpenMP: every launch is an OpenMP task whose `depend`
+ *    clauses name the launches it waits for, and its tasks run as a
+ *    taskloop. Only built when compiling with -fopenmp.
+ *  - TaskSystemStdAsync: every launch is a std::async call which waits
+ *    for the futures of its dependencies and then forks std::async
+ *    helpers over its tasks.
+ */
+
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <future>
+#include <mutex>
+#include <thread>
+#include <vector>
+#include "itasksys.h"
+#include "graph.h"
+
+#ifdef _OPENMP
+#include <omp.h>
+
+/*
+ * The launches are submitted to a dispatcher thread which sits in the
+ * `single` block of a parallel region with one more thread than the
+ * workers, and turns every launch into a task there: OpenMP only orders
+ * `depend` clauses between sibling tasks, so all top level launches must
+ * be created by the same task. A launch submitted from inside a task of
+ * ours becomes a child of that task instead, and sync() or wait() there
+ * is a taskwait, which only orders it after launches of the same task.
+ */
+class TaskSystemOpenMP: public ITaskSystem {
+    private:
+        struct Launch {
+            IRunnable* runnable;
+            int num_total_tasks;
+            TaskID id;
+            std::vector<char*> deps; // The depend objects of unfinished dependencies
+        };
+
+        int num_threads_;
+        GraphRecorder recorder_;
+        std::mutex mutex_; // guards everything below
+        std::condition_variable cv_;
+        std::deque<Launch> submitted_; // Waiting for the dispatcher
+        std::deque<char> marks_; // Depend object of every TaskID, never moves
+        std::deque<char> done_; // Indexed by TaskID
+        int outstanding_ = 0;
+        bool terminate_ = false;
+        std::thread dispatcher_;
+
+        static TaskSystemOpenMP*& current() {
+            static thread_local TaskSystemOpenMP* system = nullptr;
+            return system;
+        }
+
+        bool insideTask() {
+            return current() == this;
+        }
+
+        Launch newLaunch(IRunnable* runnable, int num_total_tasks, const std::vector<TaskID>& deps) {
+            std::lock_guard<std::mutex> guard{mutex_};
+            Launch launch{runnable, num_total_tasks, (TaskID)marks_.size(), {}};
+            for (TaskID dep : deps) {
+                if (dep >= 0 && dep < launch.id && !done_[dep]) {
+                    launch.deps.push_back(&marks_[dep]);
+                }
+            }
+            marks_.push_back(0);
+            done_.push_back(0);
+            outstanding_++;
+            return launch;
+        }
+
+        void spawn(const Launch& launch) {
+            char* out;
+            {
+                std::lock_guard<std::mutex> guard{mutex_};
+                out = &marks_[launch.id];
+            }
+            char* const* deps = launch.deps.data();
+            int num_deps = (int)launch.deps.size();
+            (void)deps; // Only used by the iterator, which GCC does not count
+            #pragma omp task firstprivate(launch) depend(iterator(k = 0:num_deps), in: deps[k][0]) \
+                             depend(out: out[0])
+            {
+                runLaunch(launch);
+            }
+        }
+
+        /*
+         * The tasks of a taskloop may run on any thread of the team, so
+         * every one of them marks its thread as inside one of our tasks.
+         */
+        void runTasks(IRunnable* runnable, int num_total_tasks) {
+            #pragma omp taskloop
+            for (int i = 0; i < num_total_tasks; i++) {
+                TaskSystemOpenMP* outer = current();
+                current() = this;
+                runnable->runTask(i, num_total_tasks);
+                current() = outer;
+            }
+        }
+
+        void runLaunch(const Launch& launch) {
+            runTasks(launch.runnable, launch.num_total_tasks);
+            std::lock_guard<std::mutex> guard{mutex_};
+            done_[launch.id] = 1;
+            outstanding_--;
+            cv_.notify_all();
+        }
+
+        void dispatch() {
+            #pragma omp parallel num_threads(num_threads_ + 1)
+            #pragma omp single
+            {
+                while (true) {
+                    Launch launch;
+                    {
+                        std::unique_lock<std::mutex> lock{mutex_};
+                        cv_.wait(lock, [this]{ return terminate_ || !submitted_.empty(); });
+                        if (submitted_.empty()) break;
+                        launch = submitted_.front();
+                        submitted_.pop_front();
+                    }
+                    spawn(launch);
+                }
+            }
+        }
+
+    public:
+        TaskSystemOpenMP(int num_threads)
+          : ITaskSystem(num_threads), num_threads_(std::max(1, num_threads)) {
+            dispatcher_ = std::thread(&TaskSystemOpenMP::dispatch, this);
+        }
+
+        ~TaskSystemOpenMP() {
+            {
+                std::lock_guard<std::mutex> guard{mutex_};
+                terminate_ = true;
+            }
+            cv_.notify_all();
+            dispatcher_.join();
+        }
+
+        const char* name() {
+            return "OpenMP Tasks";
+        }
+
+        void run(IRunnable* runnable, int num_total_tasks) {
+            if (insideTask()) {
+                runTasks(runnable, num_total_tasks);
+                return;
+            }
+            wait(runAsyncWithDeps(runnable, num_total_tasks, {}));
+        }
+
+        TaskID runAsyncWithDeps(IRunnable* runnable, int num_total_tasks,
+                                const std::vector<TaskID>& deps) {
+            if (recorder_.active()) {
+                return recorder_.record(runnable, num_total_tasks, deps);
+            }
+            Launch launch = newLaunch(runnable, num_total_tasks, deps);
+            if (insideTask()) {
+                spawn(launch);
+                return launch.id;
+            }
+            {
+                std::lock_guard<std::mutex> guard{mutex_};
+                submitted_.push_back(launch);
+            }
+            cv_.notify_all();
+            return launch.id;
+        }
+
+        void sync() {
+            if (insideTask()) {
+                #pragma omp taskwait
+                return;
+            }
+            std::unique_lock<std::mutex> lock{mutex_};
+            cv_.wait(lock, [this]{ return outstanding_ == 0; });
+        }
+
+        void wait(TaskID task_id) {
+            if (insideTask()) {
+                #pragma omp taskwait
+                return;
+            }
+            std::unique_lock<std::mutex> lock{mutex_};
+            if (task_id < 0 || task_id >= (TaskID)done_.size()) return;
+            cv_.wait(lock, [&]{ return done_[task_id] != 0; });
+        }
+
+        bool isDone(TaskID task_id) {
+            std::lock_guard<std::mutex> guard{mutex_};
+            return task_id < 0 || task_id >= (TaskID)done_.size() || done_[task_id] != 0;
+        }
+
+        TaskID waitAny(const std::vector<TaskID>& task_ids) {
+            if (task_ids.empty()) return -1;
+            TaskID first = -1;
+            std::unique_lock<std::mutex> lock{mutex_};
+            cv_.wait(lock, [&]{
+                for (TaskID task_id : task_ids) {
+                    if (task_id < 0 || task_id >= (TaskID)done_.size() || done_[task_id]) {
+                        first = task_id;
+                        return true;
+                    }
+                }
+                return false;
+            });
+            return first;
+        }
+
+        void beginCapture() {
+            recorder_.begin();
+        }
+
+        GraphID endCapture() {
+            return recorder_.end();
+        }
+
+        void launchGraph(GraphID graph_id) {
+            const TaskGraph* graph = recorder_.graph(graph_id);
+            if (graph == nullptr) return;
+            std::vector<TaskID> ids;
+            for (int i = 0; i < graph->size(); i++) {
+                std::vector<TaskID> deps;
+                for (int k = graph->dep_offsets[i]; k < graph->dep_offsets[i + 1]; k++) {
+                    deps.push_back(ids[graph->deps[k]]);
+                }
+                ids.push_back(runAsyncWithDeps(graph->nodes[i].runnable, graph->nodes[i].num_total_tasks, deps));
+            }
+        }
+};
+
+#endif
+
+/*
+ * A launch runs on its own std::async thread once the futures of its
+ * dependencies are ready, and forks up to `num_threads - 1` more
+ * std::async helpers which pull task ids from a shared counter. There is
+ * no pool: every launch pays for creating its threads, which is the
+ * overhead a task system is there to avoid.
+ */
+class TaskSystemStdAsync: public ITaskSystem {
+    private:
+        int num_threads_;
+        GraphRecorder recorder_;
+        std::mutex mutex_; // guards `futures_`
+        std::vector<std::shared_future<void>> futures_; // Indexed by TaskID
+
+        /*
+         * The launches submitted by the task running on this thread, so
+         * that sync() inside a task does not wait for the task itself.
+         */
+        static std::vector<TaskID>*& children() {
+            static thread_local std::vector<TaskID>* launched = nullptr;
+            return launched;
+        }
+
+        void runTasks(IRunnable* runnable, int num_total_tasks, std::atomic<int>& next) {
+            std::vector<TaskID>* outer = children();
+            std::vector<TaskID> launched;
+            children() = &launched;
+            for (int i = next++; i < num_total_tasks; i = next++) {
+                launched.clear();
+                runnable->runTask(i, num_total_tasks);
+            }
+            children() = outer;
+        }
+
+        void runLaunch(IRunnable* runnable, int num_total_tasks) {
+            std::atomic<int> next(0);
+            int num_helpers = std::min(num_total_tasks, num_threads_) - 1;
+            std::vector<std::future<void>> helpers;
+            for (int h = 0; h < num_helpers; h++) {
+                helpers.push_back(std::async(std::launch::async, [&]{
+                    runTasks(runnable, num_total_tasks, next);
+                }));
+            }
+            runTasks(runnable, num_total_tasks, next);
+            for (auto& helper : helpers) {
+                helper.wait();
+            }
+        }
+
+        std::shared_future<void> future(TaskID task_id) {
+            std::lock_guard<std::mutex> guard{mutex_};
+            if (task_id < 0 || task_id >= (TaskID)futures_.size()) return std::shared_future<void>();
+            return futures_[task_id];
+        }
+
+    public:
+        TaskSystemStdAsync(int num_threads)
+          : ITaskSystem(num_threads), num_threads_(std::max(1, num_threads)) {}
+
+        ~TaskSystemStdAsync() {
+            sync();
+        }
+
+        const char* name() {
+            return "std::async per launch";
+        }
+
+        void run(IRunnable* runnable, int num_total_tasks) {
+            runLaunch(runnable, num_total_tasks);
+        }
+
+        TaskID runAsyncWithDeps(IRunnable* runnable, int num_total_tasks,
+                                const std::vector<TaskID>& deps) {
+            if (recorder_.active()) {
+                return recorder_.record(runnable, num_total_tasks, deps);
+            }
+            std::vector<std::shared_future<void>> before;
+            for (TaskID dep : deps) {
+                std::shared_future<void> dep_future = future(dep);
+                if (dep_future.valid()) before.push_back(dep_future);
+            }
+            std::shared_future<void> launch = std::async(std::launch::async, [=]{
+                for (auto& dep_future : before) {
+                    dep_future.wait();
+                }
+                runLaunch(runnable, num_total_tasks);
+            }).share();
+            TaskID task_id;
+            {
+                std::lock_guard<std::mutex> guard{mutex_};
+                task_id = (TaskID)futures_.size();
+                futures_.push_back(launch);
+            }
+            if (children() != nullptr) {
+                children()->push_back(task_id);
+            }
+            return task_id;
+        }
+
+        void sync() {
+            if (children() != nullptr) {
+                std::vector<TaskID> launched;
+                launched.swap(*children());
+                for (TaskID task_id : launched) {
+                    wait(task_id);
+                }
+                return;
+            }
+            // Running launches may submit more, so wait until no new
+            // future shows up.
+            size_t waited = 0;
+            while (true) {
+                std::vector<std::shared_future<void>> pending;
+                {
+                    std::lock_guard<std::mutex> guard{mutex_};
+                    if (waited == futures_.size()) return;
+                    pending.assign(futures_.begin() + waited, futures_.end());
+                    waited = futures_.size();
+                }
+                for (auto& launch : pending) {
+                    launch.wait();
+                }
+            }
+        }
+
+        void wait(TaskID task_id) {
+            std::shared_future<void> launch = future(task_id);
+            if (launch.valid()) launch.wait();
+        }
+
+        bool isDone(TaskID task_id) {
+            std::shared_future<void> launch = future(task_id);
+            return !launch.valid() ||
+                   launch.wait_for(std::chrono::seconds(0)) == std::future_status::ready;
+        }
+
+        TaskID waitAny(const std::vector<TaskID>& task_ids) {
+            if (task_ids.empty()) return -1;
+            while (true) {
+                for (TaskID task_id : task_ids) {
+                    if (isDone(task_id)) return task_id;
+                }
+                std::this_thread::yield();
+            }
+        }
+
+        void beginCapture() {
+            recorder_.begin();
+        }
+
+        GraphID endCapture() {
+            return recorder_.end();
+        }
+
+        void launchGraph(GraphID graph_id) {
+            const TaskGraph* graph = recorder_.graph(graph_id);
+            if (graph == nullptr) return;
+            std::vector<TaskID> ids;
+            for (int i = 0; i < graph->size(); i++) {
+                std::vector<TaskID> deps;
+                for (int k = graph->dep_offsets[i]; k < graph->dep_offsets[i + 1]; k++) {
+                    deps.push_back(ids[graph->deps[k]]);
+                }
+                ids.push_back(runAsyncWithDeps(graph->nodes[i].runnable, graph->nodes[i].num_total_tasks, deps));
+            }
+        }
+};
+
+#endif
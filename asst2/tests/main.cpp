@@ -2,13 +2,21 @@
 #include <stdio.h>
 #include <getopt.h>
 #include <string>
+#include <vector>
+#include <algorithm>
+#include <cmath>
+#include <thread>
 #include <assert.h>
 
 #include "tasksys.h"
+#include "backends.h"
 #include "tests.h"
+#include "trace.h"
 
 #define DEFAULT_NUM_THREADS 8
 #define DEFAULT_NUM_TIMING_ITERATIONS 3
+#define DEFAULT_NUM_WARMUP_ITERATIONS 1
+#define DEFAULT_NUM_BENCH_ITERATIONS 10
 
 
 void usage(const char* progname, std::string *testnames, int num_tests) {
@@ -16,6 +24,15 @@ void usage(const char* progname, std::string *testnames, int num_tests) {
     printf("Program Options:\n");
     printf("  -n  --num_threads  <INT>      Number of threads: <INT> (default=%d)\n", DEFAULT_NUM_THREADS);
     printf("  -i  --num_timing_iterations <INT> Number of timing iterations: <INT> (default=%d)\n", DEFAULT_NUM_TIMING_ITERATIONS);
+    printf("  -t  --trace <FILE>            Write a Chrome trace of every run to <FILE>\n");
+    printf("  -b  --bench                   Benchmark mode: print timing statistics as CSV\n");
+    printf("  -w  --warmup <INT>            Benchmark mode: untimed runs per task system (default=%d)\n", DEFAULT_NUM_WARMUP_ITERATIONS);
+    printf("  -r  --reps <INT>              Benchmark mode: timed runs per task system (default=%d)\n", DEFAULT_NUM_BENCH_ITERATIONS);
+    printf("  -s  --sweep                   Benchmark mode: use 1, 2, 4 ... hardware threads instead of -n\n");
+    printf("  -j  --json                    Benchmark mode: print JSON instead of CSV\n");
+    printf("  -S  --stats                   Print the counters of each task system after its last run\n");
+    printf("  -R  --reference               Also run the OpenMP and std::async task systems, and compare\n"
+           "                                every system with the best one\n");
     printf("  -?  --help                    This message\n");
     printf("Valid testnames are:");
     for(int i = 0; i < num_tests; i++) {
@@ -28,9 +45,104 @@ enum TaskSystemType {
     PARALLEL_SPAWN,
     PARALLEL_THREAD_POOL_SPINNING,
     PARALLEL_THREAD_POOL_SLEEPING,
+    OPENMP_TASKS, // Reference runtimes, see backends.h
+    STD_ASYNC,
     N_TASKSYS_IMPLS, // This must be in the last position.
 };
 
+/*
+ * Timing statistics over the repetitions of one test. Percentiles use
+ * the nearest rank, the standard deviation is the sample one.
+ */
+struct BenchStats {
+    double mean;
+    double median;
+    double p95;
+    double p99;
+    double stddev;
+    double min;
+    double max;
+};
+
+double percentile(const std::vector<double>& sorted, double p) {
+    size_t rank = (size_t)std::ceil(p / 100. * sorted.size());
+    return sorted[std::max<size_t>(rank, 1) - 1];
+}
+
+BenchStats summarize(std::vector<double> samples) {
+    BenchStats stats;
+    std::sort(samples.begin(), samples.end());
+    double sum = 0;
+    for (double x : samples) sum += x;
+    stats.mean = sum / samples.size();
+    double squares = 0;
+    for (double x : samples) squares += (x - stats.mean) * (x - stats.mean);
+    stats.stddev = samples.size() > 1 ? std::sqrt(squares / (samples.size() - 1)) : 0;
+    stats.median = percentile(samples, 50);
+    stats.p95 = percentile(samples, 95);
+    stats.p99 = percentile(samples, 99);
+    stats.min = samples.front();
+    stats.max = samples.back();
+    return stats;
+}
+
+/*
+ * The outcome of one test on one task system, `time` in milliseconds is
+ * the one compared across systems.
+ */
+struct SystemResult {
+    std::string system;
+    double time;
+    BenchStats bench;
+    TaskSystemStats counters;
+};
+
+double bestTime(const std::vector<SystemResult>& results) {
+    double best = 1e30;
+    for (const SystemResult& result : results) {
+        best = std::min(best, result.time);
+    }
+    return best > 0 ? best : 1e-9;
+}
+
+/*
+ * Print the counters of a task system, see ITaskSystem::stats().
+ */
+void printStats(FILE* out, const std::string& system, const TaskSystemStats& stats) {
+    fprintf(out, "[%s] launches submitted %ld, completed %ld, max queue depth %ld, "
+            "dependency time %.3f ms\n", system.c_str(), stats.launches_submitted,
+            stats.launches_completed, stats.max_queue_depth, stats.dependency_time * 1000);
+    if (stats.workers.empty()) {
+        fprintf(out, "    no per-worker counters\n");
+        return;
+    }
+    fprintf(out, "    %-8s %10s %8s %8s %10s %10s %10s\n",
+            "worker", "tasks", "steals", "failed", "work_ms", "spin_ms", "sleep_ms");
+    auto row = [&](const std::string& who, const WorkerStats& w) {
+        fprintf(out, "    %-8s %10ld %8ld %8ld %10.3f %10.3f %10.3f\n", who.c_str(), w.tasks,
+                w.steals, w.failed_steals, w.work_time * 1000, w.spin_time * 1000,
+                w.sleep_time * 1000);
+    };
+    for (size_t i = 0; i < stats.workers.size(); i++) {
+        row(std::to_string(i), stats.workers[i]);
+    }
+    row("callers", stats.callers);
+}
+
+/*
+ * 1, 2, 4 ... up to the hardware concurrency, which ends the list even
+ * if it is not a power of two.
+ */
+std::vector<int> sweepThreadCounts() {
+    int max_threads = std::max(1u, std::thread::hardware_concurrency());
+    std::vector<int> counts;
+    for (int n = 1; n < max_threads; n *= 2) {
+        counts.push_back(n);
+    }
+    counts.push_back(max_threads);
+    return counts;
+}
+
 ITaskSystem *selectTaskSystemRefImpl(int num_threads, TaskSystemType type) {
     assert(type < N_TASKSYS_IMPLS);
 
@@ -42,16 +154,42 @@ ITaskSystem *selectTaskSystemRefImpl(int num_threads, TaskSystemType type) {
         return new TaskSystemParallelThreadPoolSpinning(num_threads);
     } else if (type == PARALLEL_THREAD_POOL_SLEEPING) {
         return new TaskSystemParallelThreadPoolSleeping(num_threads);
+#ifdef _OPENMP
+    } else if (type == OPENMP_TASKS) {
+        return new TaskSystemOpenMP(num_threads);
+#endif
+    } else if (type == STD_ASYNC) {
+        return new TaskSystemStdAsync(num_threads);
     } else {
         return NULL;
     }
 }
 
+/*
+ * Whether to run task system `type`. The reference runtimes only run when
+ * asked for, and the OpenMP one needs -fopenmp.
+ */
+bool runTaskSystem(TaskSystemType type, bool reference) {
+    if (type >= OPENMP_TASKS && !reference) return false;
+#ifndef _OPENMP
+    if (type == OPENMP_TASKS) return false;
+#endif
+    return true;
+}
+
 int main(int argc, char** argv)
 {
-    const int n_tests = 29;
+    const int n_tests = 38;
     int num_threads = DEFAULT_NUM_THREADS;
     int num_timing_iterations = DEFAULT_NUM_TIMING_ITERATIONS;
+    const char* trace_file = NULL;
+    bool bench = false;
+    bool sweep = false;
+    bool json = false;
+    bool print_stats = false;
+    bool reference = false;
+    int num_warmup_iterations = DEFAULT_NUM_WARMUP_ITERATIONS;
+    int num_bench_iterations = DEFAULT_NUM_BENCH_ITERATIONS;
 
     TestResults (*test[n_tests])(ITaskSystem*) = {
         pingPongEqualTest,
@@ -81,6 +219,17 @@ int main(int argc, char** argv)
         strictGraphDepsSmall,
         strictGraphDepsMedium,
         strictGraphDepsLarge,
+        waitForLaunchTest,
+        mathOperationsInTightForLoopFanInGraphTest,
+        mathOperationsInTightForLoopReductionTreeGraphTest,
+        superLightParallelForTest,
+        superLightParallelReduceTest,
+        mathOperationsInTightForLoopParallelForTest,
+        recursiveFibonacciNestedTest,
+        recursiveFibonacciNestedAsyncTest,
+        resizeConcurrencyTest,
+        tinyLaunchesAsyncTest,
+        concurrentSubmitAsyncTest,
     };
 
     std::string test_names[n_tests] = {
@@ -111,6 +260,17 @@ int main(int argc, char** argv)
         "strict_graph_deps_small_async",
         "strict_graph_deps_med_async",
         "strict_graph_deps_large_async",
+        "wait_for_launch_async",
+        "math_operations_in_tight_for_loop_fan_in_graph",
+        "math_operations_in_tight_for_loop_reduction_tree_graph",
+        "super_light_parallel_for",
+        "super_light_parallel_reduce",
+        "math_operations_in_tight_for_loop_parallel_for",
+        "recursive_fibonacci_nested",
+        "recursive_fibonacci_nested_async",
+        "resize_concurrency",
+        "tiny_launches_async",
+        "concurrent_submit_async",
     };
  
     // Parse commandline options
@@ -118,10 +278,19 @@ int main(int argc, char** argv)
     static struct option long_options[] = {
         {"num_threads",           1, 0,  'n'},
         {"num_timing_iterations", 1, 0,  'i'},
+        {"trace",                 1, 0,  't'},
+        {"bench",                 0, 0,  'b'},
+        {"warmup",                1, 0,  'w'},
+        {"reps",                  1, 0,  'r'},
+        {"sweep",                 0, 0,  's'},
+        {"json",                  0, 0,  'j'},
+        {"stats",                 0, 0,  'S'},
+        {"reference",             0, 0,  'R'},
         {"help",                  0, 0,  '?'},
+        {0,                       0, 0,  0},
     };
 
-    while ((opt = getopt_long(argc, argv, "n:i:?", long_options, NULL)) != EOF) {
+    while ((opt = getopt_long(argc, argv, "n:i:t:bw:r:sjSR?", long_options, NULL)) != EOF) {
 
         switch (opt) {
         case 'n':
@@ -130,6 +299,30 @@ int main(int argc, char** argv)
         case 'i':
             num_timing_iterations = atoi(optarg);
             break;
+        case 't':
+            trace_file = optarg;
+            break;
+        case 'b':
+            bench = true;
+            break;
+        case 'w':
+            num_warmup_iterations = atoi(optarg);
+            break;
+        case 'r':
+            num_bench_iterations = std::max(1, atoi(optarg));
+            break;
+        case 's':
+            sweep = true;
+            break;
+        case 'j':
+            json = true;
+            break;
+        case 'S':
+            print_stats = true;
+            break;
+        case 'R':
+            reference = true;
+            break;
         case '?':
         default:
             usage(argv[0], test_names, n_tests);
@@ -145,6 +338,31 @@ int main(int argc, char** argv)
 
     std::string test_name = argv[optind];
 
+    if (trace_file) {
+        traceStart();
+        traceThreadName("main");
+    }
+
+    // Run a test once on a fresh task system, exit if it fails
+    std::string system;
+    TaskSystemStats last_stats;
+    auto runOnce = [&](int test_id, int impl, int threads, const char* what, int j) {
+        ITaskSystem *t = selectTaskSystemRefImpl(threads, (TaskSystemType) impl);
+        system = t->name();
+        traceProcess(system + " " + what + " #" + std::to_string(j));
+        TestResults result = test[test_id](t);
+        if (!result.passed) {
+            printf("ERROR: Results did not pass correctness check! (%s=%d, ref_impl=%s)\n",
+                what, j, t->name());
+            exit(1);
+        }
+        if (print_stats) {
+            last_stats = t->stats();
+        }
+        delete t;
+        return result.time;
+    };
+
     bool found = false;
     for (int test_id = 0; test_id < n_tests; test_id++) {
         if (test_names[test_id].compare(test_name) != 0) {
@@ -152,38 +370,90 @@ int main(int argc, char** argv)
         }
 
         found = true;
+        if (bench) {
+            std::vector<int> thread_counts = sweep ? sweepThreadCounts() : std::vector<int>{num_threads};
+            if (json) {
+                printf("[\n");
+            } else {
+                printf("test,system,threads,warmup,reps,mean_ms,median_ms,p95_ms,p99_ms,stddev_ms,min_ms,max_ms,"
+                       "ratio_to_best\n");
+            }
+            bool first = true;
+            for (int threads : thread_counts) {
+                // Rows are printed once every system ran, so that each can
+                // be compared with the best median
+                std::vector<SystemResult> results;
+                for (int i = 0; i < N_TASKSYS_IMPLS; i++) {
+                    if (!runTaskSystem((TaskSystemType) i, reference)) continue;
+                    for (int j = 0; j < num_warmup_iterations; j++) {
+                        runOnce(test_id, i, threads, "warmup", j);
+                    }
+                    std::vector<double> samples;
+                    for (int j = 0; j < num_bench_iterations; j++) {
+                        samples.push_back(runOnce(test_id, i, threads, "rep", j) * 1000);
+                    }
+                    BenchStats stats = summarize(samples);
+                    results.push_back({system, stats.median, stats, last_stats});
+                }
+                double best = bestTime(results);
+                for (const SystemResult& result : results) {
+                    const BenchStats& stats = result.bench;
+                    if (json) {
+                        printf("%s  {\"test\": \"%s\", \"system\": \"%s\", \"threads\": %d, "
+                               "\"warmup\": %d, \"reps\": %d, \"mean_ms\": %.3f, \"median_ms\": %.3f, "
+                               "\"p95_ms\": %.3f, \"p99_ms\": %.3f, \"stddev_ms\": %.3f, "
+                               "\"min_ms\": %.3f, \"max_ms\": %.3f, \"ratio_to_best\": %.3f}",
+                               first ? "" : ",\n", test_name.c_str(), result.system.c_str(), threads,
+                               num_warmup_iterations, num_bench_iterations, stats.mean, stats.median,
+                               stats.p95, stats.p99, stats.stddev, stats.min, stats.max,
+                               result.time / best);
+                    } else {
+                        printf("%s,\"%s\",%d,%d,%d,%.3f,%.3f,%.3f,%.3f,%.3f,%.3f,%.3f,%.3f\n",
+                               test_name.c_str(), result.system.c_str(), threads,
+                               num_warmup_iterations, num_bench_iterations, stats.mean, stats.median,
+                               stats.p95, stats.p99, stats.stddev, stats.min, stats.max,
+                               result.time / best);
+                    }
+                    first = false;
+                    fflush(stdout);
+                    if (print_stats) {
+                        printStats(stderr, result.system, result.counters);
+                    }
+                }
+            }
+            if (json) {
+                printf("\n]\n");
+            }
+            continue;
+        }
+
         printf("============================================================="
                "======================\n");
         printf("Test name: %s\n", test_names[test_id].c_str());
         printf("============================================================="
                "======================\n");
 
+        std::vector<SystemResult> results;
         for (int i = 0; i < N_TASKSYS_IMPLS; i++) {
+            if (!runTaskSystem((TaskSystemType) i, reference)) continue;
             double minT = 1e30;
             for (int j = 0; j < num_timing_iterations; j++) {
 
-                // Create a new task system
-                ITaskSystem *t = selectTaskSystemRefImpl(num_threads, (TaskSystemType) i);
-
-                // Run test
-                TestResults result = test[test_id](t);
-
-                // Check that the test result was correct
-                if (!result.passed) {
-                    printf("ERROR: Results did not pass correctness check! (iter=%d, ref_impl=%s)\n",
-                        j, t->name());
-                    exit(1);
-                }
-
-                minT = std::min(minT, result.time);
-
-                // TODO: do this better
-                if( j+1 == num_timing_iterations) {
-                    printf("[%s]:\t\t[%.3f] ms\n", t->name(), minT * 1000);
-                }
-
-                // Shutdown task system so each timing run is from a clean start
-                delete t;
+                // Each timing run starts from a clean task system
+                minT = std::min(minT, runOnce(test_id, i, num_threads, "iter", j));
+            }
+            results.push_back({system, minT * 1000, BenchStats(), last_stats});
+        }
+        double best = bestTime(results);
+        for (const SystemResult& result : results) {
+            if (reference) {
+                printf("[%s]:\t\t[%.3f] ms\t(%.2fx best)\n", result.system.c_str(), result.time,
+                       result.time / best);
+            } else {
+                printf("[%s]:\t\t[%.3f] ms\n", result.system.c_str(), result.time);
+            }
+            if (print_stats) {
+                printStats(stdout, result.system, result.counters);
             }
         }
         printf("============================================================="
@@ -195,5 +465,10 @@ int main(int argc, char** argv)
         return 1;
     }
 
+    if (trace_file && !traceWrite(trace_file)) {
+        fprintf(stderr, "Error: could not write %s\n", trace_file);
+        return 1;
+    }
+
     return 0;
 }
@@ -0,0 +1,222 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <getopt.h>
+#include <string>
+#include <vector>
+#include <algorithm>
+#include <memory>
+
+#include "CycleTimer.h"
+#include "coro.h"
+
+/*
+ * Runs many multi-stage pipelines on the sleeping thread pool, written
+ * once as coroutines over CoTaskSystem and once by threading TaskIDs
+ * through runAsyncWithDeps(), and checks both compute the same thing.
+ */
+
+#define DEFAULT_NUM_THREADS 8
+#define DEFAULT_NUM_TIMING_ITERATIONS 3
+#define DEFAULT_NUM_PIPELINES 1000
+#define DEFAULT_NUM_STAGES 4
+
+#define ELEMENTS 256 // Per pipeline
+#define TASKS 8 // Per stage launch
+#define FAN_OUT 4 // Launches per fanned out stage
+
+
+void usage(const char* progname) {
+    printf("Usage: %s [options] testname\n", progname);
+    printf("Program Options:\n");
+    printf("  -n  --num_threads  <INT>      Number of threads: <INT> (default=%d)\n", DEFAULT_NUM_THREADS);
+    printf("  -i  --num_timing_iterations <INT> Number of timing iterations: <INT> (default=%d)\n", DEFAULT_NUM_TIMING_ITERATIONS);
+    printf("  -p  --pipelines <INT>         Pipelines in flight at once (default=%d)\n", DEFAULT_NUM_PIPELINES);
+    printf("  -s  --stages <INT>            Stages per pipeline (default=%d)\n", DEFAULT_NUM_STAGES);
+    printf("  -?  --help                    This message\n");
+    printf("Valid testnames are: chain, fan_out\n");
+}
+
+/*
+ * Each task adds `amount_` to its share of the elements [begin_, end_),
+ * with a little arithmetic per element so that a stage is not free.
+ */
+class AddTask: public IRunnable {
+    public:
+        int* data_;
+        int begin_;
+        int end_;
+        int amount_;
+        AddTask(int* data, int begin, int end, int amount)
+            : data_(data), begin_(begin), end_(end), amount_(amount) {}
+        ~AddTask() {}
+
+        void runTask(int task_id, int num_total_tasks) {
+            int size = end_ - begin_;
+            int lo = begin_ + size * task_id / num_total_tasks;
+            int hi = begin_ + size * (task_id + 1) / num_total_tasks;
+            for (int i = lo; i < hi; i++) {
+                int value = data_[i];
+                for (int j = 0; j < 32; j++) {
+                    value = value * 3 % 1000003;
+                }
+                data_[i] += amount_ + (value < 0);
+            }
+        }
+};
+
+/*
+ * Stage s of a chain adds s + 1 to every element.
+ */
+Pipeline chainPipeline(CoTaskSystem& ts, int* data, int stages) {
+    for (int s = 0; s < stages; s++) {
+        AddTask stage(data, 0, ELEMENTS, s + 1);
+        co_await ts.launch(&stage, TASKS);
+    }
+}
+
+void chainTaskIDs(ITaskSystem* t, std::vector<int>& data, int pipelines, int stages,
+                  std::vector<std::unique_ptr<AddTask>>& runnables) {
+    for (int p = 0; p < pipelines; p++) {
+        TaskID previous = -1;
+        for (int s = 0; s < stages; s++) {
+            runnables.emplace_back(new AddTask(&data[p * ELEMENTS], 0, ELEMENTS, s + 1));
+            std::vector<TaskID> deps;
+            if (previous >= 0) deps.push_back(previous);
+            previous = t->runAsyncWithDeps(runnables.back().get(), TASKS, deps);
+        }
+    }
+}
+
+int chainExpected(int stages) {
+    return stages * (stages + 1) / 2;
+}
+
+/*
+ * Each stage of a fanned out pipeline adds s + 1 to every element with
+ * FAN_OUT launches over a slice each, joined before the next stage.
+ */
+Pipeline fanOutPipeline(CoTaskSystem& ts, int* data, int stages) {
+    for (int s = 0; s < stages; s++) {
+        std::vector<AddTask> slices;
+        for (int k = 0; k < FAN_OUT; k++) {
+            slices.emplace_back(data, ELEMENTS * k / FAN_OUT, ELEMENTS * (k + 1) / FAN_OUT, s + 1);
+        }
+        std::vector<TaskID> ids;
+        for (AddTask& slice : slices) {
+            ids.push_back(ts.submit(&slice, TASKS / 2));
+        }
+        co_await ts.after(ids);
+    }
+}
+
+void fanOutTaskIDs(ITaskSystem* t, std::vector<int>& data, int pipelines, int stages,
+                   std::vector<std::unique_ptr<AddTask>>& runnables) {
+    for (int p = 0; p < pipelines; p++) {
+        std::vector<TaskID> previous;
+        for (int s = 0; s < stages; s++) {
+            std::vector<TaskID> ids;
+            for (int k = 0; k < FAN_OUT; k++) {
+                runnables.emplace_back(new AddTask(&data[p * ELEMENTS], ELEMENTS * k / FAN_OUT,
+                                                   ELEMENTS * (k + 1) / FAN_OUT, s + 1));
+                ids.push_back(t->runAsyncWithDeps(runnables.back().get(), TASKS / 2, previous));
+            }
+            previous = ids;
+        }
+    }
+}
+
+bool check(const std::vector<int>& data, int expected) {
+    for (size_t i = 0; i < data.size(); i++) {
+        if (data[i] != expected) {
+            printf("%zu: %d expected=%d\n", i, data[i], expected);
+            return false;
+        }
+    }
+    return true;
+}
+
+int main(int argc, char** argv) {
+    int num_threads = DEFAULT_NUM_THREADS;
+    int num_timing_iterations = DEFAULT_NUM_TIMING_ITERATIONS;
+    int pipelines = DEFAULT_NUM_PIPELINES;
+    int stages = DEFAULT_NUM_STAGES;
+
+    static struct option long_options[] = {
+        {"help", 0, 0, '?'},
+        {"num_threads", 1, 0, 'n'},
+        {"num_timing_iterations", 1, 0, 'i'},
+        {"pipelines", 1, 0, 'p'},
+        {"stages", 1, 0, 's'},
+        {0 ,0, 0, 0}
+    };
+
+    int opt;
+    while ((opt = getopt_long(argc, argv, "n:i:p:s:?", long_options, NULL)) != EOF) {
+        switch (opt) {
+        case 'n':
+            num_threads = atoi(optarg);
+            break;
+        case 'i':
+            num_timing_iterations = atoi(optarg);
+            break;
+        case 'p':
+            pipelines = std::max(1, atoi(optarg));
+            break;
+        case 's':
+            stages = std::max(1, atoi(optarg));
+            break;
+        case '?':
+        default:
+            usage(argv[0]);
+            return 1;
+        }
+    }
+    if (optind >= argc) {
+        usage(argv[0]);
+        return 1;
+    }
+    std::string test_name = argv[optind];
+    bool fan_out = test_name == "fan_out";
+    if (!fan_out && test_name != "chain") {
+        usage(argv[0]);
+        return 1;
+    }
+
+    printf("===================================================================================\n");
+    printf("Test name: %s, %d pipelines of %d stages\n", test_name.c_str(), pipelines, stages);
+    printf("===================================================================================\n");
+
+    const char* names[] = {"Coroutines", "TaskID chains"};
+    for (int impl = 0; impl < 2; impl++) {
+        double minT = 1e30;
+        for (int j = 0; j < num_timing_iterations; j++) {
+            TaskSystemParallelThreadPoolSleeping system(num_threads);
+            CoTaskSystem ts(system);
+            std::vector<int> data(pipelines * ELEMENTS, 0);
+            std::vector<std::unique_ptr<AddTask>> runnables;
+
+            double start = CycleTimer::currentSeconds();
+            if (impl == 0) {
+                for (int p = 0; p < pipelines; p++) {
+                    int* slice = &data[p * ELEMENTS];
+                    ts.spawn(fan_out ? fanOutPipeline(ts, slice, stages) : chainPipeline(ts, slice, stages));
+                }
+            } else if (fan_out) {
+                fanOutTaskIDs(&system, data, pipelines, stages, runnables);
+            } else {
+                chainTaskIDs(&system, data, pipelines, stages, runnables);
+            }
+            ts.sync();
+            minT = std::min(minT, CycleTimer::currentSeconds() - start);
+
+            if (!check(data, chainExpected(stages))) {
+                printf("ERROR: Results did not pass correctness check! (iter=%d, impl=%s)\n",
+                    j, names[impl]);
+                return 1;
+            }
+        }
+        printf("[%s]:\t\t[%.3f] ms\n", names[impl], minT * 1000);
+    }
+    printf("===================================================================================\n");
+    return 0;
+}
@@ -1,4 +1,5 @@
 import argparse
+import math
 import platform
 import re
 import subprocess
@@ -25,6 +26,13 @@ LIST_OF_TESTS = [
     ("math_operations_in_tight_for_loop_reduction_tree", UNSPECIFIED_NUM_THREADS),
     ("spin_between_run_calls", UNSPECIFIED_NUM_THREADS),
     ("mandelbrot_chunked", UNSPECIFIED_NUM_THREADS),
+    # Large machines: the thread pools must not depend on the worker count.
+    ("super_super_light", 64),
+    ("super_super_light", 128),
+    ("super_light", 64),
+    ("super_light", 128),
+    ("mandelbrot_chunked", 64),
+    ("mandelbrot_chunked", 128),
 ]
 
 LIST_OF_IMPLEMENTATIONS_ORIG = [
@@ -67,6 +75,26 @@ def run_test(cmd, is_reference):
         print("%s solution failed correctness check!" % ("REFERENCE" if is_reference else "STUDENT"))
     return runtimes
 
+def sweep_thread_counts():
+    # 1, 2, 4 ... up to the number of execution contexts
+    counts = []
+    n = 1
+    while n < multiprocessing.cpu_count():
+        counts.append(n)
+        n *= 2
+    counts.append(multiprocessing.cpu_count())
+    return counts
+
+def bench_stats(samples):
+    # Same statistics as `runtasks --bench`: nearest-rank percentiles
+    # and the sample standard deviation
+    samples = sorted(samples)
+    n = len(samples)
+    mean = sum(samples) / n
+    stddev = math.sqrt(sum((x - mean) ** 2 for x in samples) / (n - 1)) if n > 1 else 0.0
+    rank = lambda p: samples[max(int(math.ceil(p / 100.0 * n)), 1) - 1]
+    return [mean, rank(50), rank(95), rank(99), stddev, samples[0], samples[-1]]
+
 def pretty_print(test_name, runtimes):
     print("Results for: %s" % test_name)
     for implementation in LIST_OF_IMPLEMENTATIONS_ORIG:
@@ -112,6 +140,10 @@ if __name__ == '__main__':
                             x[0] for x in LIST_OF_TESTS]))
     parser.add_argument('-a', '--run_async', action='store_true',
                         help='Run async tests')
+    parser.add_argument('-s', '--sweep', action='store_true',
+                        help='Run every test with 1, 2, 4 ... up to all execution contexts')
+    parser.add_argument('-o', '--csv', type=str, default=None,
+                        help='Write per-test statistics over the %d runs of each binary to a CSV file' % NUM_TEST_RUNS)
 
     args = parser.parse_args()
 
@@ -123,13 +155,19 @@ if __name__ == '__main__':
         if x[0] not in args.test_names:
             continue
 
-        if x[1] == UNSPECIFIED_NUM_THREADS:
-            num_threads = args.num_threads
+        if args.sweep:
+            # The fixed thread counts are covered by the sweep
+            if x[1] != UNSPECIFIED_NUM_THREADS:
+                continue
+            thread_counts = sweep_thread_counts()
+        elif x[1] == UNSPECIFIED_NUM_THREADS:
+            thread_counts = [args.num_threads]
         else:
-            num_threads = x[1]
-        test_names_and_num_threads.append( (x[0], num_threads) )
-        if args.run_async:
-            test_names_and_num_threads.append( (x[0] + "_async", num_threads) )
+            thread_counts = [x[1]]
+        for num_threads in thread_counts:
+            test_names_and_num_threads.append( (x[0], num_threads) )
+            if args.run_async:
+                test_names_and_num_threads.append( (x[0] + "_async", num_threads) )
 
     print("==============================================================="
           "=================")
@@ -142,12 +180,17 @@ if __name__ == '__main__':
     runtimes_of_test = {}
     impl_perf_ok = {impl: True for impl in LIST_OF_IMPLEMENTATIONS}
 
+    csv = None
+    if args.csv:
+        csv = open(args.csv, "w")
+        csv.write("test,author,system,threads,reps,mean_ms,median_ms,p95_ms,p99_ms,stddev_ms,min_ms,max_ms\n")
+
     # run all tests
     for (test_name, num_threads) in test_names_and_num_threads:
         
         print("==============================================================="
               "=================")
-        print("Executing test: %s..." %  test_name)
+        print("Executing test: %s (%d threads)..." %  (test_name, num_threads))
 
         # Use the right binary for OSX / Linux
         if platform.system() == 'Darwin':
@@ -174,6 +217,13 @@ if __name__ == '__main__':
                     if key not in all_runtimes:
                         all_runtimes[key] = []
                     all_runtimes[key] += runtimes[key]
+        if csv:
+            for key in sorted(all_runtimes):
+                author, impl = key.split(" ", 1)
+                stats = bench_stats(all_runtimes[key])
+                csv.write("%s,%s,\"%s\",%d,%d,%s\n" % (test_name, author, impl[1:-1], num_threads,
+                          len(all_runtimes[key]), ",".join("%.3f" % x for x in stats)))
+                csv.flush()
         for key in all_runtimes:
             all_runtimes[key] = min(all_runtimes[key])
         pretty_print_with_comparison(test_name, all_runtimes, PERF_THRESHOLD, impl_perf_ok)
@@ -9,6 +9,7 @@
 
 #include "CycleTimer.h"
 #include "itasksys.h"
+#include "parallel.h"
 
 /*
 Sync tests
@@ -30,13 +31,30 @@ TestResults pingPongEqualAsyncTest(ITaskSystem *t);
 TestResults pingPongUnequalAsyncTest(ITaskSystem *t);
 TestResults superLightAsyncTest(ITaskSystem *t);
 TestResults superSuperLightAsyncTest(ITaskSystem *t);
+TestResults tinyLaunchesAsyncTest(ITaskSystem *t);
 TestResults recursiveFibonacciAsyncTest(ITaskSystem* t);
+TestResults recursiveFibonacciNestedTest(ITaskSystem* t);
+TestResults recursiveFibonacciNestedAsyncTest(ITaskSystem* t);
 TestResults mathOperationsInTightForLoopAsyncTest(ITaskSystem* t);
 TestResults mathOperationsInTightForLoopFanInAsyncTest(ITaskSystem* t);
 TestResults mathOperationsInTightForLoopReductionTreeAsyncTest(ITaskSystem* t);
 TestResults spinBetweenRunCallsAsyncTest(ITaskSystem *t);
 TestResults mandelbrotChunkedAsyncTest(ITaskSystem* t);
 TestResults simpleRunDepsTest(ITaskSystem *t);
+TestResults waitForLaunchTest(ITaskSystem *t);
+TestResults resizeConcurrencyTest(ITaskSystem *t);
+TestResults concurrentSubmitAsyncTest(ITaskSystem *t);
+
+Captured graph tests
+====================
+TestResults mathOperationsInTightForLoopFanInGraphTest(ITaskSystem* t);
+TestResults mathOperationsInTightForLoopReductionTreeGraphTest(ITaskSystem* t);
+
+parallel_for / parallel_reduce tests
+====================================
+TestResults superLightParallelForTest(ITaskSystem* t);
+TestResults superLightParallelReduceTest(ITaskSystem* t);
+TestResults mathOperationsInTightForLoopParallelForTest(ITaskSystem* t);
 */
 
 /*
@@ -130,6 +148,42 @@ class RecursiveFibonacciTask: public IRunnable {
         }
 };
 
+/*
+ * Computes Fibonacci numbers by divide and conquer with nested bulk task
+ * launches: task `task_id` computes the (n_ - task_id)-th number, and
+ * above the cutoff it does so by launching a two-task child on the same
+ * task system from inside runTask(), with run() or with
+ * runAsyncWithDeps() and sync().
+ */
+class NestedFibonacciTask: public IRunnable {
+    public:
+        ITaskSystem* t_;
+        int n_;
+        int cutoff_;
+        bool do_async_;
+        int* output_;
+        NestedFibonacciTask(ITaskSystem* t, int n, int cutoff, bool do_async, int* output)
+            : t_(t), n_(n), cutoff_(cutoff), do_async_(do_async), output_(output) {}
+        ~NestedFibonacciTask() {}
+
+        int fib(int n) {
+            if (n <= cutoff_) return RecursiveFibonacciTask(n, NULL).slowFn(n);
+            int results[2];
+            NestedFibonacciTask child(t_, n - 1, cutoff_, do_async_, results);
+            if (do_async_) {
+                t_->runAsyncWithDeps(&child, 2, std::vector<TaskID>());
+                t_->sync();
+            } else {
+                t_->run(&child, 2);
+            }
+            return results[0] + results[1];
+        }
+
+        void runTask(int task_id, int num_total_tasks) {
+            output_[task_id] = fib(n_ - task_id);
+        }
+};
+
 /*
  * Each task copies its task id into the output.
  */
@@ -144,6 +198,21 @@ class LightTask: public IRunnable {
         }
 };
 
+/*
+ * Each task adds one to an element of the input.
+ */
+class IncrementTask: public IRunnable {
+    public:
+        const int *input_;
+        int *output_;
+        IncrementTask(const int *input, int *output) : input_(input), output_(output) {}
+        ~IncrementTask() {}
+
+        void runTask(int task_id, int num_total_tasks) {
+            output_[task_id] = input_[task_id] + 1;
+        }
+};
+
 /*
  * Each task performs a sequence of exp, log, and multiplication
  * operations in a tight for loop.
@@ -511,6 +580,62 @@ TestResults superLightAsyncTest(ITaskSystem* t) {
     return pingPongTest(t, true, true, num_elements, base_iters);
 }
 
+/*
+ * Computation: Many bulk task launches of a few trivial tasks each, so
+ * the test measures the fixed cost of a launch. The launches of a wave
+ * are independent of each other and all depend on the last launch of
+ * the previous wave, from which they read their input.
+ */
+TestResults tinyLaunchesAsyncTest(ITaskSystem* t) {
+    int num_waves = 512;
+    int launches_per_wave = 16;
+    int num_tasks = 16;
+    int num_launches = num_waves * launches_per_wave;
+
+    int* zeros = new int[num_tasks]();
+    int* outputs = new int[num_launches * num_tasks];
+    std::vector<IncrementTask*> runnables(num_launches);
+    for (int i = 0; i < num_launches; i++) {
+        int wave = i / launches_per_wave;
+        const int* input = wave == 0 ? zeros :
+            outputs + (wave * launches_per_wave - 1) * num_tasks;
+        runnables[i] = new IncrementTask(input, outputs + i * num_tasks);
+    }
+
+    double start_time = CycleTimer::currentSeconds();
+    std::vector<TaskID> deps;
+    for (int wave = 0; wave < num_waves; wave++) {
+        TaskID last = 0;
+        for (int j = 0; j < launches_per_wave; j++) {
+            last = t->runAsyncWithDeps(runnables[wave * launches_per_wave + j], num_tasks, deps);
+        }
+        deps = {last};
+    }
+    t->sync();
+    double end_time = CycleTimer::currentSeconds();
+
+    TestResults results;
+    results.passed = true;
+    for (int i = 0; i < num_launches && results.passed; i++) {
+        int expected = i / launches_per_wave + 1;
+        for (int j = 0; j < num_tasks; j++) {
+            if (outputs[i * num_tasks + j] != expected) {
+                printf("launch %d: %d: %d expected=%d\n", i, j, outputs[i * num_tasks + j], expected);
+                results.passed = false;
+                break;
+            }
+        }
+    }
+    results.time = end_time - start_time;
+
+    delete [] zeros;
+    delete [] outputs;
+    for (int i = 0; i < num_launches; i++)
+        delete runnables[i];
+
+    return results;
+}
+
 TestResults pingPongEqualTest(ITaskSystem* t) {
     int num_elements = 512 * 1024;
     int base_iters = 32;
@@ -598,6 +723,48 @@ TestResults recursiveFibonacciAsyncTest(ITaskSystem* t) {
     return recursiveFibonacciTestBase(t, true);
 }
 
+/*
+ * Computation: The following tests compute one large Fibonacci number
+ * with nested launches, see NestedFibonacciTask. A task system which
+ * blocks a worker in a nested run() or sync() loses that worker, or
+ * deadlocks once every worker waits.
+ */
+TestResults recursiveFibonacciNestedTestBase(ITaskSystem* t, bool do_async) {
+    int fib_index = 34;
+    int cutoff = 20;
+
+    int expected = 1;
+    int previous = 1;
+    for (int i = 2; i <= fib_index; i++) {
+        int next = expected + previous;
+        previous = expected;
+        expected = next;
+    }
+
+    int output = 0;
+    NestedFibonacciTask root(t, fib_index, cutoff, do_async, &output);
+
+    double start_time = CycleTimer::currentSeconds();
+    t->run(&root, 1);
+    double end_time = CycleTimer::currentSeconds();
+
+    TestResults result;
+    result.passed = output == expected;
+    if (!result.passed) {
+        printf("%d expected=%d\n", output, expected);
+    }
+    result.time = end_time - start_time;
+    return result;
+}
+
+TestResults recursiveFibonacciNestedTest(ITaskSystem* t) {
+    return recursiveFibonacciNestedTestBase(t, false);
+}
+
+TestResults recursiveFibonacciNestedAsyncTest(ITaskSystem* t) {
+    return recursiveFibonacciNestedTestBase(t, true);
+}
+
 /*
  * Computation: The following tests perform exps, logs, and multiplications
  * in a tight for loop. Tasks are sufficiently compute-intensive and lightweight:
@@ -691,13 +858,162 @@ TestResults mathOperationsInTightForLoopFewerTasksAsyncTest(ITaskSystem* t) {
     return mathOperationsInTightForLoopTestBase(t, 9, false, true);
 }
 
+/*
+ * The following tests run the super light ping-pong and the tight for
+ * loop workloads through parallel_for() and parallel_reduce() instead of
+ * hand-written IRunnables. They use the same sizes and task counts as
+ * superLightTest and mathOperationsInTightForLoopTest, so the overhead
+ * of the templated front-end can be compared against them.
+ */
+TestResults superLightParallelForTest(ITaskSystem* t) {
+    int num_elements = 32 * 1024;
+    int base_iters = 32;
+    int num_tasks = 64;
+    int num_bulk_task_launches = 400;
+    int grain = (num_elements + num_tasks - 1) / num_tasks;
+
+    int* input = new int[num_elements];
+    int* output = new int[num_elements];
+    for (int i=0; i<num_elements; i++) {
+        input[i] = i;
+        output[i] = 0;
+    }
+
+    double start_time = CycleTimer::currentSeconds();
+    for (int i=0; i<num_bulk_task_launches; i++) {
+        int* in = (i % 2 == 0) ? input : output;
+        int* out = (i % 2 == 0) ? output : input;
+        parallel_for(t, 0, num_elements, grain, [=](int j) {
+            out[j] = PingPongTask::ping_pong_work(base_iters, in[j]);
+        });
+    }
+    double end_time = CycleTimer::currentSeconds();
+
+    TestResults results;
+    results.passed = true;
+    int* buffer = (num_bulk_task_launches % 2 == 1) ? output : input;
+    for (int i=0; i<num_elements; i++) {
+        int expected = i + num_bulk_task_launches * (base_iters / 2);
+        if (buffer[i] != expected) {
+            results.passed = false;
+            printf("%d: %d expected=%d\n", i, buffer[i], expected);
+            break;
+        }
+    }
+    results.time = end_time - start_time;
+
+    delete [] input;
+    delete [] output;
+    return results;
+}
+
+/*
+ * Like superLightParallelForTest, but every launch also sums its output.
+ */
+TestResults superLightParallelReduceTest(ITaskSystem* t) {
+    int num_elements = 32 * 1024;
+    int base_iters = 32;
+    int num_tasks = 64;
+    int num_bulk_task_launches = 400;
+    int grain = (num_elements + num_tasks - 1) / num_tasks;
+
+    int* input = new int[num_elements];
+    int* output = new int[num_elements];
+    for (int i=0; i<num_elements; i++) {
+        input[i] = i;
+        output[i] = 0;
+    }
+    std::vector<long long> sums(num_bulk_task_launches);
+
+    double start_time = CycleTimer::currentSeconds();
+    for (int i=0; i<num_bulk_task_launches; i++) {
+        int* in = (i % 2 == 0) ? input : output;
+        int* out = (i % 2 == 0) ? output : input;
+        sums[i] = parallel_reduce(t, 0, num_elements, grain, 0LL,
+            [=](int lo, int hi, long long acc) {
+                for (int j = lo; j < hi; j++) {
+                    out[j] = PingPongTask::ping_pong_work(base_iters, in[j]);
+                    acc += out[j];
+                }
+                return acc;
+            },
+            [](long long a, long long b) { return a + b; });
+    }
+    double end_time = CycleTimer::currentSeconds();
+
+    TestResults results;
+    results.passed = true;
+    long long base = (long long)num_elements * (num_elements - 1) / 2;
+    for (int i=0; i<num_bulk_task_launches; i++) {
+        long long expected = base + (long long)num_elements * (i + 1) * (base_iters / 2);
+        if (sums[i] != expected) {
+            results.passed = false;
+            printf("launch %d: %lld expected=%lld\n", i, sums[i], expected);
+            break;
+        }
+    }
+    results.time = end_time - start_time;
+
+    delete [] input;
+    delete [] output;
+    return results;
+}
+
+TestResults mathOperationsInTightForLoopParallelForTest(ITaskSystem* t) {
+    int num_tasks = 16;
+    int num_bulk_task_launches = 2000;
+    int array_size = 512;
+    int grain = array_size / num_tasks;
+
+    float* task_output = new float[num_bulk_task_launches * array_size];
+    for (int i = 0; i < (num_bulk_task_launches * array_size); i++) {
+        task_output[i] = 0.0;
+    }
+
+    double start_time = CycleTimer::currentSeconds();
+    for (int i = 0; i < num_bulk_task_launches; i++) {
+        float* output = &task_output[i * array_size];
+        parallel_for(t, 0, array_size, grain, [=](int k) {
+            output[k] = 0.0;
+            for (int j = 1; j < 151; j++) {
+                float val;
+                if (k % 3 == 0) {
+                    val = exp(j / 100.);
+                } else if (k % 3 == 1) {
+                    val = log(j * 2.);
+                } else {
+                    val = j * 6;
+                }
+                output[k] += val;
+            }
+        });
+    }
+    double end_time = CycleTimer::currentSeconds();
+
+    TestResults result;
+    result.passed = true;
+    const int expected[3] = {349, 708, 67950};
+    for (int i = 0; i < array_size; i++) {
+        if (std::floor(task_output[i]) != expected[i % 3]) {
+            printf("%d: %f expected=%d\n", i, std::floor(task_output[i]), expected[i % 3]);
+            result.passed = false;
+        }
+    }
+    result.time = end_time - start_time;
+
+    delete [] task_output;
+    return result;
+}
+
 /*
  * Computation: The following tests perform exps, logs, and multiplications
  * in a tight for loop, then sum the outputs of the different tasks using
  * a single reduce task. The async version of this test features a computation
- * DAG with fan-in dependencies.
+ * DAG with fan-in dependencies. The graph version captures the same DAG
+ * before the timer starts and times its replay.
  */
-TestResults mathOperationsInTightForLoopFanInTestBase(ITaskSystem* t, bool do_async) {
+TestResults mathOperationsInTightForLoopFanInTestBase(ITaskSystem* t, bool do_async,
+                                                      bool do_graph = false) {
 
     int num_tasks = 64;
     int num_bulk_task_launches = 256;
@@ -718,8 +1034,7 @@ TestResults mathOperationsInTightForLoopFanInTestBase(ITaskSystem* t, bool do_as
     ReduceTask reduce_task(array_size, num_bulk_task_launches, task_output,
                            final_task_output);
 
-    double start_time = CycleTimer::currentSeconds();
-    if (do_async) {
+    auto submit = [&]() {
         std::vector<TaskID> no_deps;
         std::vector<TaskID> deps;
         for (int i = 0; i < num_bulk_task_launches; i++) {
@@ -727,6 +1042,21 @@ TestResults mathOperationsInTightForLoopFanInTestBase(ITaskSystem* t, bool do_as
             deps.push_back(task_id);
         }
         t->runAsyncWithDeps(&reduce_task, 1, deps);
+    };
+
+    GraphID graph = 0;
+    if (do_graph) {
+        t->beginCapture();
+        submit();
+        graph = t->endCapture();
+    }
+
+    double start_time = CycleTimer::currentSeconds();
+    if (do_graph) {
+        t->launchGraph(graph);
+        t->sync();
+    } else if (do_async) {
+        submit();
         t->sync();
     } else {
         for (int i = 0; i < num_bulk_task_launches; i++) {
@@ -774,13 +1104,19 @@ TestResults mathOperationsInTightForLoopFanInAsyncTest(ITaskSystem* t) {
     return mathOperationsInTightForLoopFanInTestBase(t, true);
 }
 
+TestResults mathOperationsInTightForLoopFanInGraphTest(ITaskSystem* t) {
+    return mathOperationsInTightForLoopFanInTestBase(t, true, true);
+}
+
 /*
  * Computation: The following tests perform exps, logs, and multiplications
  * in a tight for loop, then sum the outputs of the different tasks using
  * a single reduce task. The async version of this test features a binary tree
- * computation DAG.
+ * computation DAG. The graph version captures the same DAG before the
+ * timer starts and times its replay.
  */
-TestResults mathOperationsInTightForLoopReductionTreeTestBase(ITaskSystem* t, bool do_async) {
+TestResults mathOperationsInTightForLoopReductionTreeTestBase(ITaskSystem* t, bool do_async,
+                                                              bool do_graph = false) {
 
     int num_tasks = 64;
     int num_bulk_task_launches = 32;
@@ -826,8 +1162,7 @@ TestResults mathOperationsInTightForLoopReductionTreeTestBase(ITaskSystem* t, bo
         num_reduce_tasks /= 2;
     }
 
-    double start_time = CycleTimer::currentSeconds();
-    if (do_async) {
+    auto submit = [&]() {
         std::vector<TaskID> no_deps;
         std::vector<std::vector<TaskID>> all_deps;
         std::vector<std::vector<TaskID>> new_all_deps;
@@ -862,6 +1197,21 @@ TestResults mathOperationsInTightForLoopReductionTreeTestBase(ITaskSystem* t, bo
             new_all_deps.clear();
             num_reduce_tasks /= 2;
         }
+    };
+
+    GraphID graph = 0;
+    if (do_graph) {
+        t->beginCapture();
+        submit();
+        graph = t->endCapture();
+    }
+
+    double start_time = CycleTimer::currentSeconds();
+    if (do_graph) {
+        t->launchGraph(graph);
+        t->sync();
+    } else if (do_async) {
+        submit();
         t->sync();
     } else {
         for (int i = 0; i < num_bulk_task_launches; i++) {
@@ -918,6 +1268,10 @@ TestResults mathOperationsInTightForLoopReductionTreeAsyncTest(ITaskSystem* t) {
     return mathOperationsInTightForLoopReductionTreeTestBase(t, true);
 }
 
+TestResults mathOperationsInTightForLoopReductionTreeGraphTest(ITaskSystem* t) {
+    return mathOperationsInTightForLoopReductionTreeTestBase(t, true, true);
+}
+
 /*
  * Computation: In between two calls to a light weight task, these tests spawn
  * a medium weight bulk task launch that only has enough enough tasks to
@@ -1101,6 +1455,272 @@ TestResults simpleRunDepsTest(ITaskSystem *t) {
     return result;
 }
 
+/*
+ * Computation: Correctness test for wait(), isDone() and waitAny().
+ * A light launch is waited for while an unrelated compute heavy launch
+ * is still running. The light launch must be complete when wait()
+ * returns, and the launch reported by waitAny() must be done.
+ */
+TestResults waitForLaunchTest(ITaskSystem *t) {
+
+    int num_tasks = 64;
+    int fib_index = 25;
+
+    int* light_output = new int[num_tasks];
+    int* fib_output = new int[num_tasks];
+    for (int i = 0; i < num_tasks; i++) {
+        light_output[i] = -1;
+        fib_output[i] = 0;
+    }
+
+    LightTask light_task(light_output);
+    RecursiveFibonacciTask fib_task(fib_index, fib_output);
+    std::vector<TaskID> no_deps;
+
+    TestResults result;
+    result.passed = true;
+
+    double start_time = CycleTimer::currentSeconds();
+    TaskID fib_task_id = t->runAsyncWithDeps(&fib_task, num_tasks, no_deps);
+    TaskID light_task_id = t->runAsyncWithDeps(&light_task, num_tasks, no_deps);
+
+    t->wait(light_task_id);
+    if (!t->isDone(light_task_id)) {
+        result.passed = false;
+    }
+    for (int i = 0; i < num_tasks; i++) {
+        if (light_output[i] != i) {
+            printf("%d: %d expected=%d\n", i, light_output[i], i);
+            result.passed = false;
+            break;
+        }
+    }
+
+    std::vector<TaskID> either = {fib_task_id, light_task_id};
+    TaskID first = t->waitAny(either);
+    if ((first != fib_task_id && first != light_task_id) || !t->isDone(first)) {
+        result.passed = false;
+    }
+
+    t->wait(fib_task_id);
+    for (int i = 0; i < num_tasks; i++) {
+        if (fib_output[i] != 121393) {
+            printf("%d: %d expected=%d\n", i, fib_output[i], 121393);
+            result.passed = false;
+            break;
+        }
+    }
+    t->sync();
+    double end_time = CycleTimer::currentSeconds();
+
+    result.time = end_time - start_time;
+
+    delete [] light_output;
+    delete [] fib_output;
+
+    return result;
+}
+
+/*
+ * Wait up to `timeout` seconds for `t` to run at most `most` workers,
+ * returns false if it still runs more. Retiring takes effect as workers
+ * come round to it, so it may lag behind setConcurrency() and sync().
+ * Systems which do not report their workers always pass.
+ */
+bool waitForWorkers(ITaskSystem *t, int most, double timeout) {
+    double deadline = CycleTimer::currentSeconds() + timeout;
+    while (true) {
+        int live = t->stats().live_workers;
+        if (live <= most) return true;
+        if (CycleTimer::currentSeconds() > deadline) {
+            printf("%d workers running, expected at most %d\n", live, most);
+            return false;
+        }
+        std::this_thread::sleep_for(std::chrono::milliseconds(1));
+    }
+}
+
+/*
+ * Computation: Correctness test for setConcurrency(). Chains of compute
+ * heavy launches run while the cap on the number of workers changes,
+ * including while launches are still queued, and every launch must
+ * produce the same output as a serial run. Systems which report their
+ * workers must also drop to the cap after each sync, and retire idle
+ * workers down to TASKSYS_MIN_THREADS after TASKSYS_RETIRE_MS.
+ */
+TestResults resizeConcurrencyTest(ITaskSystem *t) {
+
+    int num_tasks = 64;
+    int array_size = 1 << 13;
+    int num_rounds = 12;
+    int chain_length = 3;
+    int caps[] = {1, 2, 1 << 20, 1, 3, 1 << 20};
+    int num_caps = sizeof(caps) / sizeof(caps[0]);
+
+    float* expected = new float[array_size];
+    MathOperationsInTightForLoopTask serial_task(array_size, expected);
+    for (int i = 0; i < num_tasks; i++) {
+        serial_task.runTask(i, num_tasks);
+    }
+
+    std::vector<float*> outputs;
+    std::vector<MathOperationsInTightForLoopTask*> tasks;
+    for (int i = 0; i < chain_length; i++) {
+        outputs.push_back(new float[array_size]);
+        tasks.push_back(new MathOperationsInTightForLoopTask(array_size, outputs[i]));
+    }
+
+    TestResults result;
+    result.passed = true;
+
+    double start_time = CycleTimer::currentSeconds();
+    for (int round = 0; round < num_rounds && result.passed; round++) {
+        for (int i = 0; i < chain_length; i++) {
+            for (int j = 0; j < array_size; j++) {
+                outputs[i][j] = -1.f;
+            }
+        }
+        t->setConcurrency(caps[round % num_caps]);
+        std::vector<TaskID> deps;
+        for (int i = 0; i < chain_length; i++) {
+            deps = {t->runAsyncWithDeps(tasks[i], num_tasks, deps)};
+            if (i == 0) {
+                t->setConcurrency(caps[(round + 1) % num_caps]);
+            }
+        }
+        t->sync();
+        for (int i = 0; i < chain_length && result.passed; i++) {
+            for (int j = 0; j < array_size; j++) {
+                if (outputs[i][j] != expected[j]) {
+                    printf("round %d launch %d: %d: %f expected=%f\n",
+                           round, i, j, outputs[i][j], expected[j]);
+                    result.passed = false;
+                    break;
+                }
+            }
+        }
+        if (result.passed && !waitForWorkers(t, caps[(round + 1) % num_caps], 1.0)) {
+            printf("round %d: the pool did not shrink to its cap\n", round);
+            result.passed = false;
+        }
+    }
+
+    // Once idle for longer than TASKSYS_RETIRE_MS, workers retire down to
+    // TASKSYS_MIN_THREADS.
+    t->setConcurrency(1 << 20);
+    double end_time = CycleTimer::currentSeconds();
+    if (result.passed) {
+        t->run(tasks[0], num_tasks);
+        const char* retire_ms = getenv("TASKSYS_RETIRE_MS");
+        const char* min_threads = getenv("TASKSYS_MIN_THREADS");
+        double retire = (retire_ms ? atof(retire_ms) : 100) * 1e-3;
+        int floor = std::max(1, min_threads ? atoi(min_threads) : 1);
+        if (!waitForWorkers(t, floor, retire + 2.0)) {
+            printf("idle workers did not retire\n");
+            result.passed = false;
+        }
+    }
+
+    result.time = end_time - start_time;
+
+    for (int i = 0; i < chain_length; i++) {
+        delete tasks[i];
+        delete [] outputs[i];
+    }
+    delete [] expected;
+
+    return result;
+}
+
+/*
+ * Computation: Correctness test for launches submitted by many threads at
+ * once. Every submitter builds a chain of launches, and every launch also
+ * depends on the previous launch of the neighbouring submitter, so the
+ * dependencies cross threads. A launch checks that its dependencies
+ * finished before it started, and every returned TaskID must be unique.
+ */
+TestResults concurrentSubmitAsyncTest(ITaskSystem *t) {
+
+    const int num_submitters = 16;
+    const int chain_length = 64;
+    int num_launches = num_submitters * chain_length;
+
+    bool* done = new bool[num_launches]();
+    std::atomic<TaskID>* task_ids = new std::atomic<TaskID>[num_launches];
+    std::vector<std::vector<bool*>> in_flags(num_launches);
+    std::vector<StrictDependencyTask*> tasks;
+    for (int s = 0; s < num_submitters; s++) {
+        for (int j = 0; j < chain_length; j++) {
+            int launch = s * chain_length + j;
+            task_ids[launch] = -1;
+            if (j > 0) {
+                int neighbour = (s + num_submitters - 1) % num_submitters;
+                in_flags[launch].push_back(&done[launch - 1]);
+                in_flags[launch].push_back(&done[neighbour * chain_length + j - 1]);
+            }
+        }
+    }
+    for (int i = 0; i < num_launches; i++) {
+        tasks.push_back(new StrictDependencyTask(in_flags[i], &done[i]));
+    }
+
+    auto submitter = [&](int s) {
+        int neighbour = (s + num_submitters - 1) % num_submitters;
+        for (int j = 0; j < chain_length; j++) {
+            int launch = s * chain_length + j;
+            std::vector<TaskID> deps;
+            if (j > 0) {
+                int other = neighbour * chain_length + j - 1;
+                while (task_ids[other].load() == -1) {
+                    std::this_thread::yield();
+                }
+                deps.push_back(task_ids[launch - 1].load());
+                deps.push_back(task_ids[other].load());
+            }
+            int num_tasks = (s * 7 + j) % 8 + 1;
+            task_ids[launch] = t->runAsyncWithDeps(tasks[launch], num_tasks, deps);
+        }
+    };
+
+    double start_time = CycleTimer::currentSeconds();
+    std::vector<std::thread> submitters;
+    for (int s = 0; s < num_submitters; s++) {
+        submitters.emplace_back(submitter, s);
+    }
+    for (auto& submitter_thread : submitters) {
+        submitter_thread.join();
+    }
+    t->sync();
+    double end_time = CycleTimer::currentSeconds();
+
+    TestResults result;
+    result.passed = true;
+    result.time = end_time - start_time;
+
+    std::set<TaskID> unique_ids;
+    for (int i = 0; i < num_launches; i++) {
+        if (!done[i]) {
+            printf("launch %d of submitter %d did not find its dependencies done\n",
+                   i % chain_length, i / chain_length);
+            result.passed = false;
+            break;
+        }
+        unique_ids.insert(task_ids[i].load());
+    }
+    if ((int)unique_ids.size() != num_launches) {
+        printf("%d unique TaskIDs for %d launches\n", (int)unique_ids.size(), num_launches);
+        result.passed = false;
+    }
+
+    for (auto task : tasks) {
+        delete task;
+    }
+    delete [] task_ids;
+    delete [] done;
+
+    return result;
+}
+
 /*
  * This test makes dependencies in a diamond topology are satisfied.
  */
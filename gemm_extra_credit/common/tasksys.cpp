@@ -42,7 +42,7 @@
 
   There are three task systems in this file: one built using Microsoft's
   Concurrency Runtime, one built with Apple's Grand Central Dispatch, and
-  one built on top of bare pthreads.
+  a work-stealing one built on top of bare pthreads.
 */
 
 #if defined(_WIN32) || defined(_WIN64)
@@ -79,7 +79,14 @@
   #include <sys/types.h>
   #include <sys/stat.h>
   #include <sys/param.h>
+  #include <sched.h>
+  #include <time.h>
+  #include <dlfcn.h>
   #include <vector>
+  #include <deque>
+  #include <map>
+  #include <string>
+  #include <atomic>
   #include <algorithm>
 #endif // ISPC_USE_PTHREADS
 #ifdef ISPC_IS_LINUX
@@ -91,6 +98,7 @@
 #include <assert.h>
 #include <string.h>
 #include <algorithm>
+#include "tasksys.h"
 
 // Signature of ispc-generated 'task' functions
 typedef void (*TaskFuncType)(void *data, int threadIndex, int threadCount,
@@ -335,32 +343,36 @@ private:
 
 #ifdef ISPC_USE_PTHREADS
 static void *lTaskEntry(void *arg);
+struct TaskRange;
+struct LaunchStats;
+static void lRunRange(const TaskRange &range, int threadIndex, int threadCount);
 
 class TaskGroup : public TaskGroupBase {
 public:
     TaskGroup() {
         numUnfinishedTasks = 0;
-        waitingTasks.reserve(128);
-        inActiveList = false;
+        waiting = false;
     }
 
     void Reset() {
         TaskGroupBase::Reset();
         numUnfinishedTasks = 0;
-        assert(inActiveList == false);
-        lMemFence();
+        waiting = false;
+        launchStats.clear();
     }
 
     void Launch(int baseIndex, int count);
     void Sync();
 
 private:
-    friend void *lTaskEntry(void *arg);
-
-    int32_t numUnfinishedTasks;
-    int32_t pad[3];
-    std::vector<int> waitingTasks;
-    bool inActiveList;
+    friend void lRunRange(const TaskRange &range, int threadIndex, int threadCount);
+
+    std::atomic<int32_t> numUnfinishedTasks;
+    // Set by Sync() before it blocks, so that whoever finishes the last
+    // task knows to wake it up.
+    std::atomic<bool> waiting;
+    // The launches since the last Sync(), only kept with ISPC_TASK_STATS
+    std::vector<LaunchStats *> launchStats;
 };
 
 #endif // ISPC_USE_PTHREADS
@@ -477,101 +489,524 @@ TaskGroup::Sync() {
 
 #ifdef ISPC_USE_PTHREADS
 
+/* A work-stealing task system on bare pthreads.
+
+   Every worker owns a deque of task ranges, and one more deque is shared
+   by the threads outside the pool. ISPCLaunch() pushes the whole launch
+   as a single range onto the deque of the launching thread. The owner
+   of a deque takes a grain of tasks at a time from its back, and an idle
+   thread steals half of the range at the front of someone else's deque,
+   so a launch of thousands of tasks costs a lock per grain instead of a
+   global mutex and a semaphore operation per task. ISPCSync() runs tasks
+   from the deques until its group is done, and only blocks once there
+   is nothing left to take.
+
+   Idle workers spin on the count of queued tasks for a while, then sleep
+   on a condition variable; a launch wakes at most as many of them as it
+   has tasks.
+
+   The pool is configured from the environment when the first task group
+   is created, or before that with the functions of tasksys.h:
+    - ISPC_NUM_THREADS: the threads running tasks, counting the thread
+      which calls ISPCSync(), so the pool has one worker less. Defaults
+      to the number of CPUs the process may run on.
+    - ISPC_AFFINITY: "none" (the default) leaves the workers to the
+      kernel; "compact" pins them to the CPUs the process may run on, in
+      order; a CPU list such as "0,2,4-7" pins them to those. Worker i
+      gets entry i + 1 of the list, wrapping around, since entry 0 is
+      left to the calling thread, which is never pinned.
+    - ISPC_TASK_STATS: time every task and print, at exit, the statistics
+      of the launches of each task function. See lDumpStats().
+ */
+
 static volatile int32_t lock = 0;
 
 static int nThreads;
 static pthread_t *threads = NULL;
 
-static pthread_mutex_t taskSysMutex;
-static std::vector<TaskGroup *> activeTaskGroups;
-static sem_t *workerSemaphore;
+// Launches are split into about this many grains per thread
+#define GRAINS_PER_THREAD 8
+// Polls of the queued task count before an idle worker goes to sleep
+#define IDLE_SPINS 4096
+// Failed attempts to find a task before ISPCSync() blocks
+#define SYNC_SPINS 1024
+
+struct TaskRange {
+    TaskGroup *tg;
+    int begin, end; // Task info indices [begin, end) of the group
+    int grain;
+    LaunchStats *stats; // NULL unless ISPC_TASK_STATS is set
+};
+
+struct WorkerQueue {
+    pthread_mutex_t mutex;
+    std::deque<TaskRange> ranges;
+    char pad[64];
+};
+
+// nThreads + 1 deques, the last one is for the threads outside the pool
+static WorkerQueue *queues;
+static std::atomic<int64_t> numQueuedTasks(0);
+
+static pthread_mutex_t sleepMutex;
+static pthread_cond_t sleepCond;
+static std::atomic<int> numSleepers(0);
+
+// ISPCSync() callers blocked until the last task of their group is done
+static pthread_mutex_t syncMutex;
+static pthread_cond_t syncCond;
+
+// The deque of the calling thread, nThreads outside the pool
+static thread_local int lQueueIndex = -1;
+
+// Set before the pool starts, see InitTaskSystem()
+static int configuredThreads = 0; // 0 for the default
+static std::string configuredAffinity;
+static bool affinityConfigured = false;
+static std::vector<int> workerCpus; // Empty for no pinning
+
+
+static inline void
+lLock(pthread_mutex_t *mutex) {
+    int err;
+    if ((err = pthread_mutex_lock(mutex)) != 0) {
+        fprintf(stderr, "Error from pthread_mutex_lock: %s\n", strerror(err));
+        exit(1);
+    }
+}
+
+
+static inline void
+lUnlock(pthread_mutex_t *mutex) {
+    int err;
+    if ((err = pthread_mutex_unlock(mutex)) != 0) {
+        fprintf(stderr, "Error from pthread_mutex_unlock: %s\n", strerror(err));
+        exit(1);
+    }
+}
+
+
+static inline void
+lPause() {
+#if defined(__x86_64__) || defined(__i386__)
+    __builtin_ia32_pause();
+#endif
+}
+
+
+static inline int
+lMyQueue() {
+    return lQueueIndex < 0 ? nThreads : lQueueIndex;
+}
+
+
+/* Take a grain of tasks from the back of our own deque, leaving the rest
+   of the range in place.
+ */
+static bool
+lPopLocal(int index, TaskRange &range) {
+    WorkerQueue &queue = queues[index];
+    lLock(&queue.mutex);
+    if (queue.ranges.empty()) {
+        lUnlock(&queue.mutex);
+        return false;
+    }
+    TaskRange &back = queue.ranges.back();
+    range = back;
+    if (back.end - back.begin > back.grain) {
+        range.end = back.begin + back.grain;
+        back.begin = range.end;
+    }
+    else
+        queue.ranges.pop_back();
+    lUnlock(&queue.mutex);
+    numQueuedTasks -= range.end - range.begin;
+    return true;
+}
+
+
+/* Steal from the front of the deque of `victim`: half of the range there
+   if it is larger than a grain, so the thief has something to share
+   again, and the whole range otherwise.
+ */
+static bool
+lSteal(int victim, TaskRange &range) {
+    WorkerQueue &queue = queues[victim];
+    lLock(&queue.mutex);
+    if (queue.ranges.empty()) {
+        lUnlock(&queue.mutex);
+        return false;
+    }
+    TaskRange &front = queue.ranges.front();
+    range = front;
+    int count = front.end - front.begin;
+    if (count > front.grain) {
+        range.begin = front.end - count / 2;
+        front.end = range.begin;
+    }
+    else
+        queue.ranges.pop_front();
+    lUnlock(&queue.mutex);
+
+    // Keep the stolen tasks beyond the first grain where others can
+    // steal them in turn. They stay counted as queued throughout, so
+    // that no idle worker goes to sleep on them meanwhile.
+    if (range.end - range.begin > range.grain) {
+        WorkerQueue &mine = queues[lMyQueue()];
+        TaskRange rest = range;
+        rest.begin = range.begin + range.grain;
+        range.end = rest.begin;
+        lLock(&mine.mutex);
+        mine.ranges.push_back(rest);
+        lUnlock(&mine.mutex);
+    }
+    numQueuedTasks -= range.end - range.begin;
+    return true;
+}
+
+
+/* Find a range to run: our own deque first, then the others, starting
+   at a different victim on every call.
+ */
+static bool
+lTakeWork(TaskRange &range) {
+    int self = lMyQueue();
+    if (lPopLocal(self, range))
+        return true;
+    if (numQueuedTasks.load(std::memory_order_relaxed) <= 0)
+        return false;
+
+    static thread_local uint32_t seed = 0;
+    if (seed == 0)
+        seed = (uint32_t)(self + 1) * 2654435761u;
+    seed ^= seed << 13;
+    seed ^= seed >> 17;
+    seed ^= seed << 5;
+    int numQueues = nThreads + 1;
+    int start = (int)(seed % (uint32_t)numQueues);
+    for (int i = 0; i < numQueues; ++i) {
+        int victim = (start + i) % numQueues;
+        if (victim != self && lSteal(victim, range))
+            return true;
+    }
+    return false;
+}
+
+
+///////////////////////////////////////////////////////////////////////////
+// Launch statistics
+
+static bool statsEnabled = false;
+
+/* The timings of one launch, added to by the threads running its tasks
+   and folded into the totals of its task function by ISPCSync().
+ */
+struct LaunchStats {
+    void *func;
+    int taskCount;
+    std::atomic<double> minTask, maxTask, sumTask;
+    std::atomic<double> *busy; // Seconds per thread, nThreads + 1 of them
+
+    LaunchStats(void *func_, int taskCount_)
+        : func(func_), taskCount(taskCount_), minTask(1e30), maxTask(0), sumTask(0) {
+        busy = new std::atomic<double>[nThreads + 1];
+        for (int i = 0; i <= nThreads; ++i)
+            busy[i] = 0;
+    }
+
+    ~LaunchStats() {
+        delete[] busy;
+    }
+};
+
+/* The totals over every launch of one task function. */
+struct SiteStats {
+    int64_t launches;
+    int64_t tasks;
+    double minTask, maxTask, sumTask;
+    double sumImbalance;
+    double syncWait;
+
+    SiteStats() : launches(0), tasks(0), minTask(1e30), maxTask(0), sumTask(0),
+                  sumImbalance(0), syncWait(0) {}
+};
+
+static pthread_mutex_t statsMutex;
+static std::map<void *, SiteStats> siteStats;
+
+
+static inline double
+lNow() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+
+// Store `x` unless `better(x, current value)` fails
+template <typename Better>
+static inline void
+lAtomicUpdate(std::atomic<double> &value, double x, Better better) {
+    double old = value.load(std::memory_order_relaxed);
+    while (better(x, old) && !value.compare_exchange_weak(old, x, std::memory_order_relaxed))
+        ;
+}
+
+
+static inline void
+lAtomicAddDouble(std::atomic<double> &value, double x) {
+    double old = value.load(std::memory_order_relaxed);
+    while (!value.compare_exchange_weak(old, old + x, std::memory_order_relaxed))
+        ;
+}
+
+
+/* Fold the launches a Sync() waited for into the totals of their task
+   functions. `syncWait` is the time the caller spent in Sync() without
+   running tasks, shared evenly among the launches.
+ */
+static void
+lFoldStats(const std::vector<LaunchStats *> &launches, double syncWait) {
+    lLock(&statsMutex);
+    for (size_t i = 0; i < launches.size(); ++i) {
+        LaunchStats *launch = launches[i];
+        SiteStats &site = siteStats[launch->func];
+        site.launches++;
+        site.tasks += launch->taskCount;
+        site.minTask = std::min(site.minTask, launch->minTask.load());
+        site.maxTask = std::max(site.maxTask, launch->maxTask.load());
+        site.sumTask += launch->sumTask.load();
+
+        // The busiest thread against a perfect spread over the pool.
+        double busiest = 0;
+        for (int t = 0; t <= nThreads; ++t)
+            busiest = std::max(busiest, launch->busy[t].load());
+        double even = launch->sumTask.load() / (nThreads + 1);
+        site.sumImbalance += even > 0 ? busiest / even : 1;
+        site.syncWait += syncWait / launches.size();
+        delete launch;
+    }
+    lUnlock(&statsMutex);
+}
+
+
+/* Print the totals, one line per task function. ISPC names its task
+   functions after the launching function, but they are only found by
+   name in executables linked with -rdynamic; otherwise the line gives
+   the offset in the binary, for addr2line.
+ */
+static void
+lDumpStats() {
+    lLock(&statsMutex);
+    fprintf(stderr, "ISPC task stats: %d threads (%d workers + caller)\n", nThreads + 1, nThreads);
+    fprintf(stderr, "%-40s %9s %12s %10s %10s %10s %10s %13s\n", "task function", "launches",
+            "tasks/launch", "min_us", "mean_us", "max_us", "imbalance", "sync_wait_ms");
+    for (std::map<void *, SiteStats>::iterator it = siteStats.begin(); it != siteStats.end(); ++it) {
+        char name[256];
+        Dl_info info;
+        if (dladdr(it->first, &info) && info.dli_sname)
+            snprintf(name, sizeof(name), "%s", info.dli_sname);
+        else if (dladdr(it->first, &info) && info.dli_fname) {
+            const char *file = strrchr(info.dli_fname, '/');
+            snprintf(name, sizeof(name), "%s+0x%lx", file ? file + 1 : info.dli_fname,
+                     (unsigned long)((char *)it->first - (char *)info.dli_fbase));
+        }
+        else
+            snprintf(name, sizeof(name), "%p", it->first);
+
+        const SiteStats &site = it->second;
+        fprintf(stderr, "%-40s %9lld %12.1f %10.2f %10.2f %10.2f %10.2f %13.3f\n", name,
+                (long long)site.launches, (double)site.tasks / site.launches,
+                site.minTask * 1e6, site.sumTask / site.tasks * 1e6, site.maxTask * 1e6,
+                site.sumImbalance / site.launches, site.syncWait * 1e3);
+    }
+    lUnlock(&statsMutex);
+}
+
+
+static void
+lRunRange(const TaskRange &range, int threadIndex, int threadCount) {
+    TaskGroup *tg = range.tg;
+    LaunchStats *stats = range.stats;
+    double minTask = 1e30, maxTask = 0, sumTask = 0;
+    for (int i = range.begin; i < range.end; ++i) {
+        TaskInfo *myTask = tg->GetTaskInfo(i);
+        DBG(fprintf(stderr, "running task %d from group %p\n", i, tg));
+        double start = stats ? lNow() : 0;
+        myTask->func(myTask->data, threadIndex, threadCount, myTask->taskIndex,
+                     myTask->taskCount);
+        if (stats) {
+            double elapsed = lNow() - start;
+            minTask = std::min(minTask, elapsed);
+            maxTask = std::max(maxTask, elapsed);
+            sumTask += elapsed;
+        }
+    }
 
+    // The statistics must be in before the tasks count as finished, since
+    // Sync() collects them as soon as they do.
+    if (stats) {
+        lAtomicUpdate(stats->minTask, minTask, [](double x, double old) { return x < old; });
+        lAtomicUpdate(stats->maxTask, maxTask, [](double x, double old) { return x > old; });
+        lAtomicAddDouble(stats->sumTask, sumTask);
+        lAtomicAddDouble(stats->busy[threadIndex], sumTask);
+    }
 
-static inline int32_t
-lAtomicAdd(int32_t *v, int32_t delta) {
-    int32_t origValue;
-    __asm__ __volatile__("lock\n"
-                         "xaddl %0,%1"
-                         : "=r"(origValue), "=m"(*v) : "0"(delta)
-                         : "memory");
-    return origValue;
+    // Once the count drops to 0, Sync() may return and the group be freed
+    // or reused, so the decrement must be our last access to tg. Ranges
+    // which don't finish the group just decrement. The one which does
+    // decrements under syncMutex, after reading `waiting`, so a Sync()
+    // going to sleep can't miss it.
+    int count = range.end - range.begin;
+    int32_t left = tg->numUnfinishedTasks.load();
+    while (left != count) {
+        if (tg->numUnfinishedTasks.compare_exchange_weak(left, left - count))
+            return;
+    }
+    lLock(&syncMutex);
+    bool waiting = tg->waiting.load();
+    tg->numUnfinishedTasks.fetch_sub(count);
+    if (waiting)
+        pthread_cond_broadcast(&syncCond);
+    lUnlock(&syncMutex);
 }
 
 
 static void *
 lTaskEntry(void *arg) {
     int threadIndex = (int)((int64_t)arg);
-    int threadCount = nThreads;
+    int threadCount = nThreads + 1;
+    lQueueIndex = threadIndex;
+
+    if (!workerCpus.empty()) {
+        int cpu = workerCpus[(threadIndex + 1) % workerCpus.size()];
+        cpu_set_t set;
+        CPU_ZERO(&set);
+        CPU_SET(cpu, &set);
+        int err;
+        if ((err = pthread_setaffinity_np(pthread_self(), sizeof(set), &set)) != 0)
+            fprintf(stderr, "Error pinning worker %d to CPU %d: %s\n", threadIndex, cpu,
+                    strerror(err));
+    }
 
     while (1) {
-        int err;
-        //
-        // Wait on the semaphore until we're woken up due to the arrival of
-        // more work.
-        //
-        if ((err = sem_wait(workerSemaphore)) != 0) {
-            fprintf(stderr, "Error from sem_wait: %s\n", strerror(err));
-            exit(1);
+        TaskRange range;
+        if (lTakeWork(range)) {
+            lRunRange(range, threadIndex, threadCount);
+            continue;
         }
 
-        //
-        // Acquire the mutex
-        //
-        if ((err = pthread_mutex_lock(&taskSysMutex)) != 0) {
-            fprintf(stderr, "Error from pthread_mutex_lock: %s\n", strerror(err));
-            exit(1);
+        // Work often shows up again within microseconds, spin for it for
+        // a while before going to sleep.
+        bool found = false;
+        for (int i = 0; i < IDLE_SPINS && !found; ++i) {
+            found = numQueuedTasks.load(std::memory_order_relaxed) > 0;
+            lPause();
         }
-
-        if (activeTaskGroups.size() == 0) {
-            //
-            // Task queue is empty, go back and wait on the semaphore
-            //
-            if ((err = pthread_mutex_unlock(&taskSysMutex)) != 0) {
-                fprintf(stderr, "Error from pthread_mutex_unlock: %s\n", strerror(err));
-                exit(1);
-            }
+        if (found)
             continue;
-        }
 
-        //
-        // Get the last task group on the active list and the last task
-        // from its waiting tasks list.
-        //
-        TaskGroup *tg = activeTaskGroups.back();
-        assert(tg->waitingTasks.size() > 0);
-        int taskNumber = tg->waitingTasks.back();
-        tg->waitingTasks.pop_back();
-
-        if (tg->waitingTasks.size() == 0) {
-            // We just took the last task from this task group, so remove
-            // it from the active list.
-            activeTaskGroups.pop_back();
-            tg->inActiveList = false;
-        }
+        lLock(&sleepMutex);
+        numSleepers++;
+        while (numQueuedTasks.load() <= 0)
+            pthread_cond_wait(&sleepCond, &sleepMutex);
+        numSleepers--;
+        lUnlock(&sleepMutex);
+    }
+
+    pthread_exit(NULL);
+    return 0;
+}
+
+
+static void
+lInitSync(pthread_mutex_t *mutex, pthread_cond_t *cond) {
+    int err;
+    if ((err = pthread_mutex_init(mutex, NULL)) != 0) {
+        fprintf(stderr, "Error creating mutex: %s\n", strerror(err));
+        exit(1);
+    }
+    if ((err = pthread_cond_init(cond, NULL)) != 0) {
+        fprintf(stderr, "Error creating condition variable: %s\n", strerror(err));
+        exit(1);
+    }
+}
+
 
-        if ((err = pthread_mutex_unlock(&taskSysMutex)) != 0) {
-            fprintf(stderr, "Error from pthread_mutex_unlock: %s\n", strerror(err));
-            exit(1);
+/* Parse a CPU list such as "0-3,8", empty if `text` is not one. */
+static std::vector<int>
+lParseCpuList(const char *text) {
+    std::vector<int> cpus;
+    const char *p = text;
+    while (*p) {
+        char *rest;
+        long first = strtol(p, &rest, 10);
+        long last = first;
+        if (rest == p || first < 0)
+            return std::vector<int>();
+        if (*rest == '-') {
+            p = rest + 1;
+            last = strtol(p, &rest, 10);
+            if (rest == p || last < first)
+                return std::vector<int>();
         }
+        for (long cpu = first; cpu <= last && cpu < CPU_SETSIZE; ++cpu)
+            cpus.push_back((int)cpu);
+        if (*rest == ',')
+            ++rest;
+        else if (*rest != '\0')
+            return std::vector<int>();
+        p = rest;
+    }
+    return cpus;
+}
 
-        //
-        // And now actually run the task
-        //
-        DBG(fprintf(stderr, "running task %d from group %p\n", taskNumber, tg));
-        TaskInfo *myTask = tg->GetTaskInfo(taskNumber);
-        myTask->func(myTask->data, threadIndex, threadCount, myTask->taskIndex,
-                     myTask->taskCount);
 
-        //
-        // Decrement the "number of unfinished tasks" counter in the task
-        // group.
-        //
-        lMemFence();
-        lAtomicAdd(&tg->numUnfinishedTasks, -1);
+/* The CPUs the process may run on. */
+static std::vector<int>
+lAllowedCpus() {
+    std::vector<int> cpus;
+    cpu_set_t allowed;
+    CPU_ZERO(&allowed);
+    if (sched_getaffinity(0, sizeof(allowed), &allowed) == 0)
+        for (int cpu = 0; cpu < CPU_SETSIZE; ++cpu)
+            if (CPU_ISSET(cpu, &allowed))
+                cpus.push_back(cpu);
+    return cpus;
+}
+
+
+/* Settle the size and placement of the pool from ISPCSetNumThreads(),
+   ISPCSetAffinity() and the environment, in that order.
+ */
+static void
+lConfigure() {
+    int total = configuredThreads;
+    const char *env = getenv("ISPC_NUM_THREADS");
+    if (total <= 0 && env != NULL)
+        total = atoi(env);
+    if (total <= 0) {
+        total = (int)lAllowedCpus().size();
+        if (total <= 0)
+            total = (int)sysconf(_SC_NPROCESSORS_ONLN);
+    }
+    // We launch one fewer thread than asked for, since the main thread
+    // here will also grab jobs from the task queue itself.
+    nThreads = std::max(0, total - 1);
+
+    std::string policy = configuredAffinity;
+    env = getenv("ISPC_AFFINITY");
+    if (!affinityConfigured && env != NULL)
+        policy = env;
+    if (policy == "compact")
+        workerCpus = lAllowedCpus();
+    else if (!policy.empty() && policy != "none") {
+        workerCpus = lParseCpuList(policy.c_str());
+        if (workerCpus.empty())
+            fprintf(stderr, "Unknown ISPC_AFFINITY=%s, not pinning\n", policy.c_str());
     }
 
-    pthread_exit(NULL);
-    return 0;
+    statsEnabled = getenv("ISPC_TASK_STATS") != NULL;
 }
 
 
@@ -581,39 +1016,43 @@ InitTaskSystem() {
         while (1) {
             if (lAtomicCompareAndSwap32(&lock, 1, 0) == 0) {
                 if (threads == NULL) {
-                    // We launch one fewer thread than there are cores,
-                    // since the main thread here will also grab jobs from
-                    // the task queue itself.
-                    nThreads = sysconf(_SC_NPROCESSORS_ONLN) - 1;
-
-                    int err;
-                    if ((err = pthread_mutex_init(&taskSysMutex, NULL)) != 0) {
-                        fprintf(stderr, "Error creating mutex: %s\n", strerror(err));
-                        exit(1);
+                    lConfigure();
+
+                    lInitSync(&sleepMutex, &sleepCond);
+                    lInitSync(&syncMutex, &syncCond);
+                    if (statsEnabled) {
+                        int err;
+                        if ((err = pthread_mutex_init(&statsMutex, NULL)) != 0) {
+                            fprintf(stderr, "Error creating mutex: %s\n", strerror(err));
+                            exit(1);
+                        }
+                        atexit(lDumpStats);
                     }
 
-                    char name[32];
-                    sprintf(name, "ispc_task.%d", (int)getpid());
-                    workerSemaphore = sem_open(name, O_CREAT, S_IRUSR|S_IWUSR, 0);
-                    if (!workerSemaphore) {
-                        fprintf(stderr, "Error creating semaphore: %s\n", strerror(err));
-                        exit(1);
+                    queues = new WorkerQueue[nThreads + 1];
+                    for (int i = 0; i <= nThreads; ++i) {
+                        int err;
+                        if ((err = pthread_mutex_init(&queues[i].mutex, NULL)) != 0) {
+                            fprintf(stderr, "Error creating mutex: %s\n", strerror(err));
+                            exit(1);
+                        }
                     }
 
-                    threads = (pthread_t *)malloc(nThreads * sizeof(pthread_t));
+                    pthread_t *workers = (pthread_t *)malloc(std::max(1, nThreads) * sizeof(pthread_t));
                     for (intptr_t i = 0; i < nThreads; ++i) {
-                        err = pthread_create(&threads[i], NULL, &lTaskEntry, (void *) i);
+                        int err = pthread_create(&workers[i], NULL, &lTaskEntry, (void *) i);
                         if (err != 0) {
                             fprintf(stderr, "Error creating pthread %lu: %s\n", i, strerror(err));
                             exit(1);
                         }
                     }
 
-                    activeTaskGroups.reserve(64);
+                    // Make sure all of the above goes to memory before
+                    // other threads may see `threads` set.
+                    lMemFence();
+                    threads = workers;
                 }
 
-                // Make sure all of the above goes to memory before we
-                // clear the lock.
                 lMemFence();
                 lock = 0;
                 break;
@@ -624,148 +1063,84 @@ InitTaskSystem() {
 
 
 inline void
-TaskGroup::Launch(int baseCoord, int count) {
-    //
-    // Acquire mutex, add task
-    //
-    int err;
-    if ((err = pthread_mutex_lock(&taskSysMutex)) != 0) {
-        fprintf(stderr, "Error from pthread_mutex_lock: %s\n", strerror(err));
-        exit(1);
-    }
-
-    // Add the corresponding set of tasks to the waiting-to-be-run list for
-    // this task group.
-    //
-    // FIXME: it's a little ugly to hold a global mutex for this when we
-    // only need to make sure no one else is accessing this task group's
-    // waitingTasks list.  (But a small experiment in switching to a
-    // per-TaskGroup mutex showed worse performance!)
-    for (int i = 0; i < count; ++i)
-        waitingTasks.push_back(baseCoord + i);
+TaskGroup::Launch(int baseIndex, int count) {
+    if (count <= 0)
+        return;
 
-    // Add the task group to the global active list if it isn't there
-    // already.
-    if (inActiveList == false) {
-        activeTaskGroups.push_back(this);
-        inActiveList = true;
+    // Count the tasks before any of them can run and finish.
+    numUnfinishedTasks += count;
+
+    TaskRange range;
+    range.tg = this;
+    range.begin = baseIndex;
+    range.end = baseIndex + count;
+    range.grain = std::max(1, count / (GRAINS_PER_THREAD * (nThreads + 1)));
+    range.stats = NULL;
+    if (statsEnabled) {
+        range.stats = new LaunchStats((void *)GetTaskInfo(baseIndex)->func, count);
+        launchStats.push_back(range.stats);
     }
 
-    if ((err = pthread_mutex_unlock(&taskSysMutex)) != 0) {
-        fprintf(stderr, "Error from pthread_mutex_unlock: %s\n", strerror(err));
-        exit(1);
+    WorkerQueue &queue = queues[lMyQueue()];
+    lLock(&queue.mutex);
+    queue.ranges.push_back(range);
+    lUnlock(&queue.mutex);
+    numQueuedTasks += count;
+
+    // Wake sleeping workers, no more than there are tasks for.
+    int sleepers = numSleepers.load();
+    if (sleepers > 0) {
+        lLock(&sleepMutex);
+        if (count >= sleepers)
+            pthread_cond_broadcast(&sleepCond);
+        else
+            for (int i = 0; i < count; ++i)
+                pthread_cond_signal(&sleepCond);
+        lUnlock(&sleepMutex);
     }
-
-    //
-    // Update the count of the number of tasks left to run in this task
-    // group.
-    //
-    lMemFence();
-    lAtomicAdd(&numUnfinishedTasks, count);
-
-    //
-    // Post to the worker semaphore to wake up worker threads that are
-    // sleeping waiting for tasks to show up
-    //
-    for (int i = 0; i < count; ++i)
-        if ((err = sem_post(workerSemaphore)) != 0) {
-            fprintf(stderr, "Error from sem_post: %s\n", strerror(err));
-            exit(1);
-        }
 }
 
 
 inline void
 TaskGroup::Sync() {
-    DBG(fprintf(stderr, "syncing %p - %d unfinished\n", tg, numUnfinishedTasks));
-
-    while (numUnfinishedTasks > 0) {
-        // All of the tasks in this group aren't finished yet.  We'll try
-        // to help out here since we don't have anything else to do...
-
-        DBG(fprintf(stderr, "while syncing %p - %d unfinished\n", tg,
-                    numUnfinishedTasks));
-
-        //
-        // Acquire the global task system mutex to grab a task to work on
-        //
-        int err;
-        if ((err = pthread_mutex_lock(&taskSysMutex)) != 0) {
-            fprintf(stderr, "Error from pthread_mutex_lock: %s\n", strerror(err));
-            exit(1);
-        }
-
-        TaskInfo *myTask = NULL;
-        TaskGroup *runtg = this;
-        if (waitingTasks.size() > 0) {
-            int taskNumber = waitingTasks.back();
-            waitingTasks.pop_back();
-
-            if (waitingTasks.size() == 0) {
-                // There's nothing left to start running from this group,
-                // so remove it from the active task list.
-                activeTaskGroups.erase(std::find(activeTaskGroups.begin(),
-                                                 activeTaskGroups.end(), this));
-                inActiveList = false;
-            }
-            myTask = GetTaskInfo(taskNumber);
-            DBG(fprintf(stderr, "running task %d from group %p in sync\n", taskNumber, tg));
-        }
-        else {
-            // Other threads are already working on all of the tasks in
-            // this group, so we can't help out by running one ourself.
-            // We'll try to run one from another group to make ourselves
-            // useful here.
-            if (activeTaskGroups.size() == 0) {
-                // No active task groups left--there's nothing for us to do.
-                if ((err = pthread_mutex_unlock(&taskSysMutex)) != 0) {
-                    fprintf(stderr, "Error from pthread_mutex_unlock: %s\n", strerror(err));
-                    exit(1);
-                }
-                // FIXME: We basically end up busy-waiting here, which is
-                // extra wasteful in a world with hyperthreading.  It would
-                // be much better to put this thread to sleep on a
-                // condition variable that was signaled when the last task
-                // in this group was finished.
-                sleep(0);
-                continue;
-            }
-
-            // Get a task to run from another task group.
-            runtg = activeTaskGroups.back();
-            assert(runtg->waitingTasks.size() > 0);
-
-            int taskNumber = runtg->waitingTasks.back();
-            runtg->waitingTasks.pop_back();
-            if (runtg->waitingTasks.size() == 0) {
-                // There's left to start running from this group, so remove
-                // it from the active task list.
-                activeTaskGroups.pop_back();
-                runtg->inActiveList = false;
-            }
-            myTask = runtg->GetTaskInfo(taskNumber);
-            DBG(fprintf(stderr, "running task %d from other group %p in sync\n",
-                        taskNumber, runtg));
+    DBG(fprintf(stderr, "syncing %p - %d unfinished\n", this, (int)numUnfinishedTasks));
+
+    int threadIndex = lMyQueue();
+    int threadCount = nThreads + 1;
+    int spins = 0;
+    double start = statsEnabled ? lNow() : 0;
+    double ran = 0; // Seconds spent running tasks meanwhile
+    while (numUnfinishedTasks.load() > 0) {
+        // Help out with whatever is queued, our own tasks first, since we
+        // don't have anything else to do...
+        TaskRange range;
+        if (lTakeWork(range)) {
+            double started = statsEnabled ? lNow() : 0;
+            lRunRange(range, threadIndex, threadCount);
+            if (statsEnabled)
+                ran += lNow() - started;
+            spins = 0;
+            continue;
         }
-
-        if ((err = pthread_mutex_unlock(&taskSysMutex)) != 0) {
-            fprintf(stderr, "Error from pthread_mutex_unlock: %s\n", strerror(err));
-            exit(1);
+        if (++spins < SYNC_SPINS) {
+            lPause();
+            continue;
         }
 
-        //
-        // Do work for _myTask_
-        //
-        // FIXME: bogus values for thread index/thread count here as well..
-        myTask->func(myTask->data, 0, 1, myTask->taskIndex, myTask->taskCount);
-
-        //
-        // Decrement the number of unfinished tasks counter
-        //
-        lMemFence();
-        lAtomicAdd(&runtg->numUnfinishedTasks, -1);
+        // Nothing left to take: the rest of our tasks are running on
+        // other threads, so sleep until the last of them finishes. Tasks
+        // they launch in turn are theirs to sync.
+        lLock(&syncMutex);
+        waiting = true;
+        while (numUnfinishedTasks.load() > 0)
+            pthread_cond_wait(&syncCond, &syncMutex);
+        lUnlock(&syncMutex);
+    }
+    if (!launchStats.empty()) {
+        lFoldStats(launchStats, lNow() - start - ran);
+        launchStats.clear();
     }
-    DBG(fprintf(stderr, "sync for %p done!n", tg));
+    DBG(fprintf(stderr, "sync for %p done!n", this));
 }
 
 #endif // ISPC_USE_PTHREADS
@@ -780,11 +1155,11 @@ AllocTaskGroup() {
     for (int i = 0; i < MAX_FREE_TASK_GROUPS; ++i) {
         TaskGroup *tg = freeTaskGroups[i];
         if (tg != NULL) {
+            // Another thread may have taken tg, and freed another group
+            // into the slot, meanwhile: then the swap failed and we move on.
             void *ptr = lAtomicCompareAndSwapPointer((void **)(&freeTaskGroups[i]), NULL, tg);
-            if (ptr != NULL) {
-                assert(ptr == tg);
-                return (TaskGroup *)ptr;
-            }
+            if (ptr == tg)
+                return tg;
         }
     }
 
@@ -816,6 +1191,31 @@ extern "C" {
     void ISPCSync(void *handle);
 }
 
+void
+ISPCSetNumThreads(int numThreads) {
+#ifdef ISPC_USE_PTHREADS
+    if (threads != NULL) {
+        fprintf(stderr, "ISPCSetNumThreads() after the first launch is ignored\n");
+        return;
+    }
+    configuredThreads = numThreads;
+#endif // ISPC_USE_PTHREADS
+}
+
+
+void
+ISPCSetAffinity(const char *policy) {
+#ifdef ISPC_USE_PTHREADS
+    if (threads != NULL) {
+        fprintf(stderr, "ISPCSetAffinity() after the first launch is ignored\n");
+        return;
+    }
+    configuredAffinity = policy ? policy : "";
+    affinityConfigured = true;
+#endif // ISPC_USE_PTHREADS
+}
+
+
 void
 ISPCLaunch(void **taskGroupPtr, void *func, void *data, int count) {
     TaskGroup *taskGroup;
@@ -0,0 +1,38 @@
+#ifndef _TASKSYS_H
+#define _TASKSYS_H
+
+/*
+  Configuration of the task system in tasksys.cpp, which runs the
+  'launch' statements of ispc programs.
+
+  Both calls only take effect before the first launch, and override the
+  environment variables of the same meaning:
+
+    ISPC_NUM_THREADS  Threads running tasks, counting the thread which
+                      waits for them, so the pool has one worker less.
+                      Defaults to the number of CPUs the process may use.
+    ISPC_AFFINITY     "none" (default), "compact" for the CPUs the process
+                      may use in order, or a CPU list such as "0,2,4-7".
+                      Worker i is pinned to entry i + 1 of the list; entry
+                      0 is left to the calling thread, which is not pinned.
+
+  Setting ISPC_TASK_STATS prints, at exit, the task count, per-task
+  min/mean/max time, imbalance and sync wait of the launches of every
+  task function. The imbalance is the busiest thread's share of a launch
+  against an even spread over the pool, so 1.0 is perfect.
+
+  Only the pthreads task system (Linux) honours these.
+*/
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+void ISPCSetNumThreads(int numThreads);
+void ISPCSetAffinity(const char *policy);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif